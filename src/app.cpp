@@ -15,6 +15,11 @@ App::App(Settings set, Platform* plt)
 
     if(!set.headless) assert(plt);
 
+    if(set.headless && !set.batch.empty()) {
+        run_batch(std::move(set.batch));
+        return;
+    }
+
     std::string err;
     bool loaded_scene = true;
 
@@ -31,7 +36,10 @@ App::App(Settings set, Platform* plt)
         loaded_scene = false;
     }
 
-    if(!set.env_map_file.empty()) {
+    // The window opens while the map loads; renders need it up front
+    if(!set.env_map_file.empty() && !set.headless) {
+        scene.set_env_map_async(set.env_map_file);
+    } else if(!set.env_map_file.empty()) {
         info("Loading environment map...");
         err = scene.set_env_map(set.env_map_file);
         if(!err.empty()) warn("Error loading environment map: %s", err.c_str());
@@ -44,9 +52,7 @@ App::App(Settings set, Platform* plt)
     } else if(loaded_scene) {
 
         info("Rendering scene...");
-        err = gui.get_render().headless_render(gui.get_animate(), scene, set.output_file,
-                                               set.animate, set.w, set.h, set.s, set.ls, set.d,
-                                               set.exp, set.w_from_ar);
+        err = gui.get_render().headless_render(gui.get_animate(), scene, set.render);
 
         if(!err.empty())
             warn("Error rendering scene: %s", err.c_str());
@@ -57,6 +63,59 @@ App::App(Settings set, Platform* plt)
     }
 }
 
+void App::run_batch(std::vector<Job> jobs) {
+
+    // Jobs on the same scene run back to back, so each scene is loaded once
+    // and the pathtracer keeps its mesh BVHs and environment map between them
+    std::stable_sort(jobs.begin(), jobs.end(), [](const Job& l, const Job& r) {
+        return std::tie(l.scene_file, l.env_map_file) < std::tie(r.scene_file, r.env_map_file);
+    });
+
+    const Job* loaded = nullptr;
+    size_t failed = 0;
+
+    for(size_t i = 0; i < jobs.size(); i++) {
+
+        const Job& job = jobs[i];
+        info("Job %zu of %zu: %s", i + 1, jobs.size(), job.render.output.c_str());
+
+        std::string err;
+        if(!loaded || loaded->scene_file != job.scene_file ||
+           loaded->env_map_file != job.env_map_file) {
+
+            info("Loading scene file...");
+            Scene::Load_Opts opts;
+            opts.new_scene = true;
+            err = scene.load(opts, undo, gui, job.scene_file);
+            gui.set_file(job.scene_file);
+
+            if(err.empty() && !job.env_map_file.empty()) {
+                err = scene.set_env_map(job.env_map_file);
+            }
+            loaded = err.empty() ? &job : nullptr;
+        }
+        if(!err.empty()) {
+            warn("Error loading scene: %s", err.c_str());
+            failed++;
+            continue;
+        }
+
+        err = gui.get_render().headless_render(gui.get_animate(), scene, job.render);
+        if(!err.empty()) {
+            warn("Error rendering scene: %s", err.c_str());
+            failed++;
+        } else {
+            auto [build, render] = gui.get_render().completion_time();
+            info("Built scene in %.2fs, rendered in %.2fs", build, render);
+        }
+
+        // Animations leave the scene at their last frame
+        if(job.render.animate) loaded = nullptr;
+    }
+
+    if(failed) warn("%zu of %zu jobs failed.", failed, jobs.size());
+}
+
 App::~App() {
     Renderer::shutdown();
 }
@@ -4,6 +4,7 @@
 #include <SDL2/SDL.h>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "gui/manager.h"
 #include "lib/mathlib.h"
@@ -16,6 +17,13 @@ class Platform;
 
 class App {
 public:
+    // One render of a headless batch (see --batch)
+    struct Job {
+        std::string scene_file;
+        std::string env_map_file;
+        Gui::Headless_Opts render;
+    };
+
     struct Settings {
 
         std::string scene_file;
@@ -23,15 +31,10 @@ public:
         bool headless = false;
 
         // If headless is true, use all of these
-        std::string output_file = "out.png";
-        int w = 640;
-        int h = 360;
-        int s = 128;
-        int ls = 16;
-        int d = 4;
-        bool animate = false;
-        float exp = 1.0f;
-        bool w_from_ar = false;
+        Gui::Headless_Opts render;
+
+        // If headless and not empty, render these instead
+        std::vector<Job> batch;
     };
 
     App(Settings set, Platform* plt = nullptr);
@@ -43,6 +46,7 @@ public:
 
 private:
     void apply_window_dim(Vec2 new_dim);
+    void run_batch(std::vector<Job> jobs);
     Vec3 screen_to_world(Vec2 mouse);
 
     // Camera data
@@ -203,8 +203,7 @@ void Manager::load_image(Scene_Light& light) {
     char* path = nullptr;
     NFD_OpenDialog(image_file_types, nullptr, &path);
     if(path) {
-        std::string error = light.emissive_load(std::string(path));
-        set_error(error);
+        light.emissive_load_async(std::string(path));
         free(path);
     }
     light.dirty();
@@ -454,6 +453,9 @@ void Manager::light_edit_gui(Undo& undo, Scene_Light& light) {
 
     switch(light.opt.type) {
     case Light_Type::sphere: {
+        if(light.emissive_loading()) {
+            ImGui::Text("Loading map...");
+        }
         if(light.opt.has_emissive_map) {
             float x = ImGui::GetContentRegionAvail().x;
             ImGui::Image((ImTextureID)(long long)light.emissive_texture().get_id(), {x, x / 2.0f});
@@ -466,13 +468,9 @@ void Manager::light_edit_gui(Undo& undo, Scene_Light& light) {
                 old_opt = start_opt;
                 U = true;
             }
-        } else {
+        } else if(!light.emissive_loading()) {
             if(ImGui::Button("Use Texture Map")) {
                 load_image(light);
-                if(light.opt.has_emissive_map) {
-                    old_opt = start_opt;
-                    U = true;
-                }
             }
         }
     } break;
@@ -894,6 +892,11 @@ void Manager::render_ui(Scene& scene, Undo& undo, Camera& cam) {
     UIsettings();
     UIsavefirst(scene, undo);
     set_error(animate.pump_output(scene));
+    // Starting to use a map loaded in the background can be undone, whether
+    // or not the light's editor is open when the load finishes
+    set_error(scene.pump_loads([&undo](Scene_Light& light, Scene_Light::Options old_opt) {
+        undo.update_light(light.id(), old_opt);
+    }));
 }
 
 Rig& Manager::get_rig() {
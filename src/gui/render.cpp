@@ -128,12 +128,26 @@ std::pair<float, float> Render::completion_time() const {
     return ui_render.completion_time();
 }
 
-std::string Render::headless_render(Animate& animate, Scene& scene, std::string output, bool a,
-                                    int w, int h, int s, int ls, int d, float exp, bool w_from_ar) {
-    if(w_from_ar) {
-        w = (int)std::ceil(ui_camera.get_ar() * h);
+std::string Render::headless_render(Animate& animate, Scene& scene, Headless_Opts opts) {
+    if(opts.w_from_ar) {
+        opts.w = (int)std::ceil(ui_camera.get_ar() * opts.h);
     }
-    return ui_render.headless(animate, scene, ui_camera.get(), output, a, w, h, s, ls, d, exp);
+
+    Camera cam = ui_camera.get();
+    Vec3 pos = cam.pos(), center = cam.center();
+    if(opts.cam_pos.size() == 3) pos = Vec3(opts.cam_pos[0], opts.cam_pos[1], opts.cam_pos[2]);
+    if(opts.cam_center.size() == 3) {
+        center = Vec3(opts.cam_center[0], opts.cam_center[1], opts.cam_center[2]);
+    }
+    if(opts.orbit != 0.0f) {
+        pos = center + Mat4::rotate(opts.orbit, Vec3{0.0f, 1.0f, 0.0f}).rotate(pos - center);
+    }
+    if(opts.cam_pos.size() == 3 || opts.cam_center.size() == 3 || opts.orbit != 0.0f) {
+        cam.look_at(center, pos);
+    }
+    if(opts.fov > 0.0f) cam.set_fov(opts.fov);
+
+    return ui_render.headless(animate, scene, cam, opts);
 }
 
 } // namespace Gui
@@ -10,15 +10,10 @@ namespace Gui {
 const char* Solid_Type_Names[(int)Solid_Type::count] = {"Sphere", "Cube", "Cylinder", "Torus",
                                                         "Custom"};
 
-Simulate::Simulate() : thread_pool(std::thread::hardware_concurrency()) {
+Simulate::Simulate() {
     last_update = SDL_GetPerformanceCounter();
 }
 
-Simulate::~Simulate() {
-    thread_pool.wait();
-    thread_pool.stop();
-}
-
 bool Simulate::keydown(Widgets& widgets, Undo& undo, SDL_Keysym key) {
     return false;
 }
@@ -83,23 +78,11 @@ void Simulate::build_scene(Scene& scene) {
 
     std::mutex obj_mut;
     std::vector<PT::Object> obj_list;
+    std::vector<Scene_Object*> objs;
 
-    scene.for_items([&, this](Scene_Item& item) {
+    scene.for_items([&](Scene_Item& item) {
         if(item.is<Scene_Object>()) {
-            Scene_Object& obj = item.get<Scene_Object>();
-            thread_pool.enqueue([&]() {
-                if(obj.is_shape()) {
-                    PT::Shape shape(obj.opt.shape);
-                    std::lock_guard<std::mutex> lock(obj_mut);
-                    obj_list.push_back(
-                        PT::Object(std::move(shape), obj.id(), 0, obj.pose.transform()));
-                } else {
-                    PT::Tri_Mesh mesh(obj.posed_mesh());
-                    std::lock_guard<std::mutex> lock(obj_mut);
-                    obj_list.push_back(
-                        PT::Object(std::move(mesh), obj.id(), 0, obj.pose.transform()));
-                }
-            });
+            objs.push_back(&item.get<Scene_Object>());
         } else if(item.is<Scene_Light>()) {
 
             Scene_Light& light = item.get<Scene_Light>();
@@ -112,7 +95,22 @@ void Simulate::build_scene(Scene& scene) {
         }
     });
 
-    thread_pool.wait();
+    // Interactive: the UI waits on this while a render may be running
+    Thread_Pool::get().parallel_for(0, objs.size(), 1, [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++) {
+            Scene_Object& obj = *objs[i];
+            if(obj.is_shape()) {
+                PT::Shape shape(obj.opt.shape);
+                std::lock_guard<std::mutex> lock(obj_mut);
+                obj_list.push_back(PT::Object(std::move(shape), obj.id(), 0, obj.pose.transform()));
+            } else {
+                PT::Tri_Mesh mesh(obj.posed_mesh());
+                std::lock_guard<std::mutex> lock(obj_mut);
+                obj_list.push_back(PT::Object(std::move(mesh), obj.id(), 0, obj.pose.transform()));
+            }
+        }
+    }, Task_Priority::interactive);
+
     scene_bvh.build(std::move(obj_list));
 }
 
@@ -19,7 +19,6 @@ extern const char* Solid_Type_Names[(int)Solid_Type::count];
 class Simulate {
 public:
     Simulate();
-    ~Simulate();
     bool keydown(Widgets& widgets, Undo& undo, SDL_Keysym key);
 
     void update(Scene& scene, Undo& undo);
@@ -36,7 +35,6 @@ public:
 
 private:
     PT::BVH<PT::Object> scene_bvh;
-    Thread_Pool thread_pool;
     Pose old_pose;
     size_t cur_actions = 0;
     Uint64 last_update;
@@ -1,4 +1,5 @@
 
+#include <fstream>
 #include <imgui/imgui.h>
 #include <iomanip>
 #include <iostream>
@@ -13,6 +14,7 @@
 #include "../geometry/util.h"
 #include "../platform/platform.h"
 #include "../scene/renderer.h"
+#include "../util/rand.h"
 
 namespace Gui {
 
@@ -550,7 +552,7 @@ void Widget_Camera::generate_cage() {
     cam_cage.add(br, bl, Gui::Color::black);
 }
 
-Widget_Render::Widget_Render(Vec2 dim) : pathtracer(*this, dim) {
+Widget_Render::Widget_Render(Vec2 dim) : preview_cam(dim), pathtracer(*this, dim) {
     out_w = (size_t)dim.x / 2;
     out_h = (size_t)dim.y / 2;
 }
@@ -583,8 +585,19 @@ void Widget_Render::begin(Scene& scene, Widget_Camera& cam, Camera& user_cam) {
     if(method == 1) {
         ImGui::InputInt("Samples", &out_samples, 1, 100);
         ImGui::InputInt("Area Light Samples", &out_area_samples, 1, 100);
+        ImGui::Combo("Light Sampling", &light_sampling, PT::Light_Sampling_Names,
+                     (int)PT::Light_Sampling::count);
+        if(light_sampling != (int)PT::Light_Sampling::all) {
+            ImGui::InputInt("Lights Per Hit", &out_light_samples, 1, 16);
+        }
+        ImGui::Combo("Integrator", &integrator, PT::Integrator_Names,
+                     (int)PT::Integrator::count);
+        ImGui::Combo("Env Map Storage", &env_format, Pixel_Format_Names,
+                     (int)Pixel_Format::count);
         ImGui::InputInt("Max Ray Depth", &out_depth, 1, 32);
         ImGui::SliderFloat("Exposure", &exposure, 0.01f, 10.0f, "%.2f", 2.5f);
+        ImGui::Checkbox("Progressive Preview", &progressive);
+        ImGui::Checkbox("Denoise", &denoise);
     } else {
         ImGui::Combo("Samples", (int*)&msaa.samples, GL::Sample_Count_Names, msaa.n_options());
         out_samples = msaa.n_samples();
@@ -594,6 +607,7 @@ void Widget_Render::begin(Scene& scene, Widget_Camera& cam, Camera& user_cam) {
     out_h = std::max(1, out_h);
     out_samples = std::max(1, out_samples);
     out_area_samples = std::max(1, out_area_samples);
+    out_light_samples = std::max(1, out_light_samples);
     out_depth = std::max(1, out_depth);
 
     if(ImGui::Button("Set Width via AR")) {
@@ -605,78 +619,169 @@ void Widget_Render::begin(Scene& scene, Widget_Camera& cam, Camera& user_cam) {
     }
 }
 
+// Renderer::saved gives rows bottom first, but PNGs store them top first.
+// Flipping here keeps stbi_flip_vertically_on_write, which every thread
+// shares, at its default while frames are encoded in the background.
+static void flip_rows(std::vector<unsigned char>& data, size_t w, size_t h) {
+    size_t stride = w * 4;
+    for(size_t j = 0; j < h / 2; j++) {
+        std::swap_ranges(data.begin() + j * stride, data.begin() + (j + 1) * stride,
+                         data.begin() + (h - j - 1) * stride);
+    }
+}
+
+static std::string frame_path(const std::string& folder, int frame) {
+    std::stringstream str;
+    str << std::setfill('0') << std::setw(4) << frame;
+#ifdef _WIN32
+    return folder + "\\" + str.str() + ".png";
+#else
+    return folder + "/" + str.str() + ".png";
+#endif
+}
+
 std::string Widget_Render::step(Animate& animate, Scene& scene) {
 
     if(animating) {
 
-        if(next_frame == max_frame) {
-            animating = false;
-            return {};
-        }
         if(folder.empty()) {
             animating = false;
             return "No output folder!";
         }
 
+        if(method == 1) return trace_frames(animate, scene);
+
+        if(next_frame == max_frame) {
+            animating = false;
+            return {};
+        }
+
         Camera cam = animate.set_time(scene, (float)next_frame);
         animate.step_sim(scene);
 
-        if(method == 0) {
-            std::vector<unsigned char> data;
+        std::vector<unsigned char> data;
 
-            Renderer::get().save(scene, cam, out_w, out_h, out_samples);
-            Renderer::get().saved(data);
+        Renderer::get().save(scene, cam, out_w, out_h, out_samples);
+        Renderer::get().saved(data);
+        flip_rows(data, out_w, out_h);
 
-            std::stringstream str;
-            str << std::setfill('0') << std::setw(4) << next_frame;
-#ifdef _WIN32
-            std::string path = folder + "\\" + str.str() + ".png";
-#else
-            std::string path = folder + "/" + str.str() + ".png";
-#endif
+        std::string path = frame_path(folder, next_frame);
+        if(!stbi_write_png(path.c_str(), (int)out_w, (int)out_h, 4, data.data(),
+                           (int)out_w * 4)) {
+            animating = false;
+            return "Failed to write output!";
+        }
 
-            stbi_flip_vertically_on_write(true);
-            if(!stbi_write_png(path.c_str(), (int)out_w, (int)out_h, 4, data.data(),
-                               (int)out_w * 4)) {
-                animating = false;
-                return "Failed to write output!";
-            }
+        next_frame++;
+    }
+    return {};
+}
 
-            next_frame++;
-        } else {
+std::string Widget_Render::trace_frames(Animate& animate, Scene& scene) {
 
-            if(init) {
-                pathtracer.begin_render(scene, cam);
-                init = false;
-            }
+    static const size_t max_in_flight = 2;
 
-            if(!pathtracer.in_progress()) {
-                std::vector<unsigned char> data;
+    while(!frame_writes.empty() &&
+          frame_writes.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+        std::string err = frame_writes.front().get();
+        frame_writes.pop_front();
+        if(!err.empty()) {
+            cancel_frames();
+            return err;
+        }
+    }
 
-                pathtracer.get_output().tonemap_to(data, exposure);
-                std::stringstream str;
-                str << std::setfill('0') << std::setw(4) << next_frame;
-#ifdef _WIN32
-                std::string path = folder + "\\" + str.str() + ".png";
-#else
-                std::string path = folder + "/" + str.str() + ".png";
-#endif
+    if(!frames.empty()) {
+        Frame& frame = frames.front();
 
-                stbi_flip_vertically_on_write(false);
-                if(!stbi_write_png(path.c_str(), (int)out_w, (int)out_h, 4, data.data(),
-                                   (int)out_w * 4)) {
-                    animating = false;
-                    return "Failed to write output!";
-                }
+        // Cancelling keeps the epochs accumulated so far
+        PT::Pathtracer& tracer = *frame.tracer;
+        if(tracer.in_progress() && budget_spent(tracer, frame.start)) tracer.cancel();
 
-                pathtracer.begin_render(scene, cam);
-                next_frame++;
+        if(!tracer.in_progress()) {
+            tracer.denoise();
+            write_frame(tracer.get_output().copy(), frame_path(folder, frame.index));
+            frames.pop_front();
+        }
+    }
+
+    // Evaluating and building the next frame overlaps tracing the current one.
+    // The pathtracers copy what they need, so the scene can change under them.
+    if(next_frame < max_frame && frames.size() < max_in_flight) {
+
+        PT::Pathtracer* tracer = &pathtracer;
+        if(!frames.empty() && frames.front().tracer == tracer) {
+            if(!frame_tracer) {
+                Vec2 dim((float)out_w, (float)out_h);
+                frame_tracer = std::make_unique<PT::Pathtracer>(*this, dim);
+                frame_tracer->copy_settings(pathtracer);
             }
+            tracer = frame_tracer.get();
         }
+
+        Camera cam = animate.set_time(scene, (float)next_frame);
+        animate.step_sim(scene);
+        tracer->begin_render(scene, cam);
+        frames.push_back({tracer, next_frame, std::chrono::steady_clock::now()});
+        next_frame++;
+    }
+
+    if(frames.empty() && next_frame == max_frame) {
+        animating = false;
+        std::string err;
+        for(auto& write : frame_writes) {
+            std::string write_err = write.get();
+            if(err.empty()) err = write_err;
+        }
+        frame_writes.clear();
+        return err;
     }
     return {};
 }
 
+void Widget_Render::write_frame(HDR_Image image, std::string path) {
+
+    // Don't let encoding fall arbitrarily far behind tracing
+    static const size_t max_pending = 4;
+    if(frame_writes.size() >= max_pending) frame_writes.front().wait();
+
+    // Encoded on the shared pool, behind the render tasks. tonemap_to gives
+    // rows top first, as PNGs store them.
+    auto frame = std::make_shared<HDR_Image>(std::move(image));
+    auto result = std::make_shared<std::promise<std::string>>();
+    frame_writes.push_back(result->get_future());
+    Thread_Pool::get().enqueue(
+        [frame, result, path = std::move(path), e = exposure, w = out_w, h = out_h]() {
+            std::vector<unsigned char> data;
+            frame->tonemap_to(data, e);
+            if(!stbi_write_png(path.c_str(), w, h, 4, data.data(), w * 4)) {
+                result->set_value("Failed to write output!");
+            } else {
+                result->set_value({});
+            }
+        },
+        Task_Priority::background);
+}
+
+void Widget_Render::begin_frames() {
+    frames.clear();
+    if(frame_tracer) frame_tracer->copy_settings(pathtracer);
+}
+
+void Widget_Render::cancel_frames() {
+    pathtracer.cancel();
+    if(frame_tracer) frame_tracer->cancel();
+    frames.clear();
+    animating = false;
+}
+
+float Widget_Render::animation_progress() const {
+    if(max_frame <= 0) return 1.0f;
+    float done = (float)(next_frame - (int)frames.size());
+    for(const Frame& frame : frames) done += frame.tracer->progress();
+    return done / max_frame;
+}
+
 void Widget_Render::animate(Scene& scene, Widget_Camera& cam, Camera& user_cam, int last_frame) {
 
     if(!render_window) return;
@@ -700,13 +805,12 @@ void Widget_Render::animate(Scene& scene, Widget_Camera& cam, Camera& user_cam,
     if(animating) {
 
         if(ImGui::Button("Cancel")) {
-            pathtracer.cancel();
-            animating = false;
+            cancel_frames();
         }
 
         ImGui::SameLine();
         if(method == 1) {
-            ImGui::ProgressBar(((float)next_frame + pathtracer.progress()) / (max_frame + 1));
+            ImGui::ProgressBar(animation_progress());
         } else {
             ImGui::ProgressBar((float)next_frame / (max_frame + 1));
         }
@@ -719,9 +823,14 @@ void Widget_Render::animate(Scene& scene, Widget_Camera& cam, Camera& user_cam,
             next_frame = 0;
             folder = std::string(output_path);
             if(method == 1) {
-                init = true;
                 ray_log.clear();
                 pathtracer.set_sizes(out_w, out_h, out_samples, out_area_samples, out_depth);
+                pathtracer.set_light_sampling((PT::Light_Sampling)light_sampling,
+                                              out_light_samples);
+                pathtracer.set_integrator((PT::Integrator)integrator);
+                pathtracer.set_env_format((Pixel_Format)env_format);
+                pathtracer.set_denoise(denoise);
+                begin_frames();
             }
         }
     }
@@ -731,7 +840,9 @@ void Widget_Render::animate(Scene& scene, Widget_Camera& cam, Camera& user_cam,
     float h = (w / out_w) * out_h;
 
     if(method == 1) {
-        ImGui::Image((ImTextureID)(long long)pathtracer.get_output_texture(exposure).get_id(),
+        // Show the oldest frame still being traced
+        PT::Pathtracer& tracer = frames.empty() ? pathtracer : *frames.front().tracer;
+        ImGui::Image((ImTextureID)(long long)tracer.get_output_texture(exposure).get_id(),
                      {w, h});
     } else {
         ImGui::Image((ImTextureID)(long long)Renderer::get().saved(), {w, h}, {0.0f, 1.0f},
@@ -741,6 +852,22 @@ void Widget_Render::animate(Scene& scene, Widget_Camera& cam, Camera& user_cam,
     ImGui::End();
 }
 
+bool Widget_Render::budget_spent(PT::Pathtracer& tracer,
+                                 std::chrono::steady_clock::time_point start) {
+
+    if(time_limit > 0.0f) {
+        std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+        if(elapsed.count() >= time_limit) return true;
+    }
+    if(target_noise > 0.0f && tracer.relative_error() <= target_noise) return true;
+    return false;
+}
+
+static bool same_view(const Camera& l, const Camera& r) {
+    return l.get_view() == r.get_view() && l.get_fov() == r.get_fov() &&
+           l.get_ar() == r.get_ar() && l.get_ap() == r.get_ap() && l.get_dist() == r.get_dist();
+}
+
 static bool postfix(const std::string& path, const std::string& type) {
     if(path.length() >= type.length())
         return path.compare(path.length() - type.length(), type.length(), type) == 0;
@@ -757,6 +884,11 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
     ImGui::Separator();
     ImGui::Text("Render");
 
+    if(method == 1 && progressive && has_rendered && !same_view(cam.get(), preview_cam)) {
+        preview_cam = cam.get();
+        pathtracer.begin_progressive(scene, preview_cam, false);
+    }
+
     if(pathtracer.in_progress()) {
 
         if(ImGui::Button("Cancel")) {
@@ -775,7 +907,17 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
                 ret = true;
                 ray_log.clear();
                 pathtracer.set_sizes(out_w, out_h, out_samples, out_area_samples, out_depth);
-                pathtracer.begin_render(scene, cam.get());
+                pathtracer.set_light_sampling((PT::Light_Sampling)light_sampling,
+                                              out_light_samples);
+                pathtracer.set_integrator((PT::Integrator)integrator);
+                pathtracer.set_env_format((Pixel_Format)env_format);
+                pathtracer.set_denoise(denoise);
+                if(progressive) {
+                    preview_cam = cam.get();
+                    pathtracer.begin_progressive(scene, preview_cam, true);
+                } else {
+                    pathtracer.begin_render(scene, cam.get());
+                }
             } else {
                 Renderer::get().save(scene, cam.get(), out_w, out_h, out_samples);
             }
@@ -785,8 +927,14 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
     ImGui::SameLine();
     if(ImGui::Button("Save Image")) {
         char* path = nullptr;
-        NFD_SaveDialog("png", nullptr, &path);
-        if(path) {
+        NFD_SaveDialog(method == 1 ? "png,exr" : "png", nullptr, &path);
+        if(path && method == 1 && postfix(path, ".exr")) {
+
+            // Path traced images can also be saved as linear HDR
+            err = pathtracer.save_exr(path);
+            free(path);
+
+        } else if(path) {
 
             std::string spath(path);
             if(!postfix(spath, ".png")) {
@@ -797,10 +945,9 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
 
             if(method == 1) {
                 pathtracer.get_output().tonemap_to(data, exposure);
-                stbi_flip_vertically_on_write(false);
             } else {
                 Renderer::get().saved(data);
-                stbi_flip_vertically_on_write(true);
+                flip_rows(data, out_w, out_h);
             }
 
             if(!stbi_write_png(spath.c_str(), (int)out_w, (int)out_h, 4, data.data(),
@@ -818,6 +965,9 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
         }
     }
 
+    // Shows the filtered image once the render finishes (if enabled)
+    if(method == 1 && has_rendered && !pathtracer.in_progress()) pathtracer.denoise();
+
     float avail = ImGui::GetContentRegionAvail().x;
     float w = std::min(avail, (float)out_w);
     float h = (w / out_w) * out_h;
@@ -840,21 +990,48 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
 }
 
 std::string Widget_Render::headless(Animate& animate, Scene& scene, const Camera& cam,
-                                    std::string output, bool a, int w, int h, int s, int ls, int d,
-                                    float exp) {
+                                    const Headless_Opts& opts) {
 
     info("Render settings:");
-    info("\twidth: %d", w);
-    info("\theight: %d", h);
-    info("\tsamples: %d", s);
-    info("\tlight samples: %d", ls);
-    info("\tmax depth: %d", d);
-    info("\texposure: %f", exp);
-    info("\trender threads: %u", std::thread::hardware_concurrency());
-
-    out_w = w;
-    out_h = h;
-    pathtracer.set_sizes(w, h, s, ls, d);
+    info("\twidth: %d", opts.w);
+    info("\theight: %d", opts.h);
+    info("\tsamples: %d", opts.s);
+    info("\tlight samples: %d", opts.ls);
+    info("\tlight sampling: %s", PT::Light_Sampling_Names[opts.lm]);
+    if(opts.lm != (int)PT::Light_Sampling::all) info("\tlights per hit: %d", opts.nl);
+    info("\tintegrator: %s", PT::Integrator_Names[opts.in]);
+    info("\tenv map storage: %s", Pixel_Format_Names[opts.ef]);
+    info("\tmax depth: %d", opts.d);
+    info("\tseed: %llu", (unsigned long long)opts.seed);
+    info("\texposure: %f", opts.exp);
+    info("\trender threads: %zu", Thread_Pool::get().size());
+
+    if(opts.shards < 1 || opts.shard < 0 || opts.shard >= opts.shards) {
+        return "Invalid shard " + std::to_string(opts.shard) + " of " +
+               std::to_string(opts.shards) + "!";
+    }
+    if(opts.shards > 1) {
+        info("\tshard: %d of %d (by %s)", opts.shard, opts.shards,
+             PT::Shard_Mode_Names[opts.shard_by]);
+    }
+    if(opts.time_limit > 0.0f) info("\ttime limit: %.2fs", opts.time_limit);
+    if(opts.target_noise > 0.0f) info("\ttarget noise: %f", opts.target_noise);
+    if(opts.denoise) info("\tdenoise: on");
+
+    time_limit = opts.time_limit;
+    target_noise = opts.target_noise;
+
+    out_w = opts.w;
+    out_h = opts.h;
+    pathtracer.set_sizes(opts.w, opts.h, opts.s, opts.ls, opts.d);
+    pathtracer.set_light_sampling((PT::Light_Sampling)opts.lm, opts.nl);
+    pathtracer.set_integrator((PT::Integrator)opts.in);
+    pathtracer.set_env_format((Pixel_Format)opts.ef);
+    pathtracer.set_shard((PT::Shard_Mode)opts.shard_by, opts.shard, opts.shards);
+    pathtracer.set_aovs(opts.aovs);
+    pathtracer.set_denoise(opts.denoise);
+    pathtracer.set_display(false);
+    RNG::set_render_seed(opts.seed);
 
     auto print_progress = [](float f) {
         std::cout << "Progress: [";
@@ -874,34 +1051,121 @@ std::string Widget_Render::headless(Animate& animate, Scene& scene, const Camera
     };
 
     std::cout << std::fixed << std::setw(2) << std::setprecision(2) << std::setfill('0');
-    if(a) {
+    if(opts.animate) {
+
+        if(!opts.checkpoint.empty() || !opts.resume.empty()) {
+            warn("Checkpoints are not supported for animations.");
+        }
+        if(opts.shards > 1) {
+            return "Sharding is not supported for animations!";
+        }
 
         method = 1;
-        init = true;
         animating = true;
         max_frame = animate.n_frames();
         next_frame = 0;
-        folder = output;
-        while(next_frame < max_frame) {
+        begin_frames();
+        folder = opts.output;
+        while(animating) {
             std::string err = step(animate, scene);
             if(!err.empty()) return err;
-            print_progress(((float)next_frame + pathtracer.progress()) / (max_frame + 1));
-            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+            print_progress(animation_progress());
+            // Wakes up as soon as the oldest frame finishes
+            if(!frames.empty()) frames.front().tracer->wait_for(std::chrono::milliseconds(250));
         }
         std::cout << std::endl;
 
+    } else if(opts.stream_rows > 0) {
+
+        if(!postfix(opts.output, ".exr")) return "Streamed renders must be written to EXR!";
+        if(opts.shards > 1 || !opts.checkpoint.empty() || !opts.resume.empty()) {
+            return "Streamed renders can't be sharded or checkpointed!";
+        }
+        if(opts.time_limit > 0.0f || opts.target_noise > 0.0f) {
+            warn("Streamed renders ignore time limits and noise targets.");
+        }
+        if(opts.denoise) warn("Streamed renders are not denoised.");
+        pathtracer.set_denoise(false);
+
+        // Bands go top to bottom, as EXR rows do, in whole compressed blocks
+        size_t block = EXR::Stream_Writer::block_rows;
+        size_t band = (opts.stream_rows + block - 1) / block * block;
+        size_t h = opts.h;
+
+        EXR::Stream_Writer writer;
+        for(size_t top = h, bottom; top > 0; top = bottom) {
+            bottom = top > band ? top - band : 0;
+
+            // The first band builds the scene; the rest reuse it
+            pathtracer.set_window(bottom, top);
+            pathtracer.begin_render(scene, cam, top != h);
+            while(pathtracer.in_progress()) {
+                float rows = (h - top) + pathtracer.progress() * (top - bottom);
+                print_progress(rows / h);
+                pathtracer.wait_for(std::chrono::milliseconds(250));
+            }
+
+            std::vector<EXR::Channel> channels = pathtracer.exr_channels();
+            if(top == h) {
+                std::vector<std::string> names;
+                for(const EXR::Channel& channel : channels) names.push_back(channel.name);
+                std::string err = writer.open(opts.output, opts.w, h, std::move(names));
+                if(!err.empty()) return err;
+            }
+            std::string err = writer.write_rows(std::move(channels));
+            if(!err.empty()) return err;
+        }
+        std::cout << std::endl;
+        return writer.close();
+
     } else {
 
-        pathtracer.begin_render(scene, cam);
+        render_start = std::chrono::steady_clock::now();
+        if(!opts.resume.empty() && std::ifstream(opts.resume).good()) {
+            info("Resuming from %s", opts.resume.c_str());
+            std::string err = pathtracer.resume_render(scene, cam, opts.resume);
+            if(!err.empty()) return err;
+        } else {
+            pathtracer.begin_render(scene, cam);
+        }
+
+        // Keep checkpointing to the file we resumed from by default
+        std::string checkpoint = opts.checkpoint.empty() ? opts.resume : opts.checkpoint;
+        auto interval = std::chrono::duration<float>(opts.checkpoint_interval);
+        auto last_checkpoint = std::chrono::steady_clock::now();
+
         while(pathtracer.in_progress()) {
             print_progress(pathtracer.progress());
-            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+            pathtracer.wait_for(std::chrono::milliseconds(250));
+
+            if(budget_spent(pathtracer, render_start)) {
+                pathtracer.cancel();
+                std::cout << std::endl;
+                info("Stopping early, writing the samples accumulated so far.");
+                break;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if(!checkpoint.empty() && now - last_checkpoint >= interval) {
+                std::string err = pathtracer.save_checkpoint(checkpoint);
+                if(!err.empty()) warn("Error saving checkpoint: %s", err.c_str());
+                last_checkpoint = now;
+            }
         }
         std::cout << std::endl;
 
+        // Each shard is merged later with the merge subcommand
+        if(opts.shards > 1) {
+            if(opts.denoise) warn("Partial renders are not denoised.");
+            return pathtracer.save_partial(opts.output);
+        }
+        pathtracer.denoise();
+        if(postfix(opts.output, ".exr")) return pathtracer.save_exr(opts.output);
+        if(opts.aovs) warn("AOVs are only written to EXR outputs.");
+
         std::vector<unsigned char> data;
-        pathtracer.get_output().tonemap_to(data, exp);
-        if(!stbi_write_png(output.c_str(), w, h, 4, data.data(), w * 4)) {
+        pathtracer.get_output().tonemap_to(data, opts.exp);
+        if(!stbi_write_png(opts.output.c_str(), opts.w, opts.h, 4, data.data(), opts.w * 4)) {
             return "Failed to write output!";
         }
     }
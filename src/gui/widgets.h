@@ -1,6 +1,11 @@
 
 #pragma once
 
+#include <chrono>
+#include <deque>
+#include <future>
+#include <memory>
+
 #include "../lib/mathlib.h"
 #include "../rays/pathtracer.h"
 #include "../scene/scene.h"
@@ -73,6 +78,52 @@ private:
     void generate_cage();
 };
 
+// Settings for rendering without the GUI (see --headless)
+struct Headless_Opts {
+    std::string output = "out.png";
+    int w = 640;
+    int h = 360;
+    int s = 128;
+    int ls = 16;
+    int lm = 0;
+    int nl = 1;
+    int in = 0;
+    int ef = 0;
+    int d = 4;
+    bool animate = false;
+    float exp = 1.0f;
+    bool w_from_ar = false;
+
+    std::string checkpoint, resume;
+    float checkpoint_interval = 60.0f;
+
+    int shard = 0;
+    int shards = 1;
+    int shard_by = 0;
+
+    // Key of every pixel's random sample streams (see RNG::set_stream)
+    uint64_t seed = 0;
+
+    // Also write depth, normal, albedo and object id channels to EXR outputs
+    bool aovs = false;
+    // Filter the image before writing it (see PT::denoise)
+    bool denoise = false;
+
+    // Stop early once either is reached (0 disables)
+    float time_limit = 0.0f;
+    float target_noise = 0.0f;
+
+    // Trace the image this many rows at a time, writing each band to the EXR
+    // output as it finishes (0 traces the whole image at once)
+    int stream_rows = 0;
+
+    // Camera overrides; empty or zero values keep the scene's camera
+    std::vector<float> cam_pos, cam_center;
+    float fov = 0.0f;
+    // Degrees to orbit the camera about the vertical axis through its center
+    float orbit = 0.0f;
+};
+
 class Widget_Render {
 public:
     Widget_Render(Vec2 dim);
@@ -83,8 +134,8 @@ public:
     void animate(Scene& scene, Widget_Camera& cam, Camera& user_cam, int max_frame);
     std::string step(Animate& animate, Scene& scene);
 
-    std::string headless(Animate& animate, Scene& scene, const Camera& cam, std::string output,
-                         bool a, int w, int h, int s, int ls, int d, float exp);
+    std::string headless(Animate& animate, Scene& scene, const Camera& cam,
+                         const Headless_Opts& opts);
 
     void log_ray(const Ray& ray, float t, Spectrum color = Spectrum{1.0f});
     void render_log(const Mat4& view) const;
@@ -107,23 +158,55 @@ public:
 
 private:
     void begin(Scene& scene, Widget_Camera& cam, Camera& user_cam);
+    bool budget_spent(PT::Pathtracer& tracer, std::chrono::steady_clock::time_point start);
+
+    std::string trace_frames(Animate& animate, Scene& scene);
+    void write_frame(HDR_Image image, std::string path);
+    // Clear the frames in flight and give the second pathtracer the main
+    // one's settings, once per animation
+    void begin_frames();
+    void cancel_frames();
+    float animation_progress() const;
 
     mutable std::mutex log_mut;
     GL::Lines ray_log;
 
     int out_w, out_h, out_samples = 32, out_area_samples = 8, out_depth = 4;
+    int light_sampling = 0, out_light_samples = 4, integrator = 0, env_format = 0;
     float exposure = 1.0f;
 
     bool has_rendered = false;
     bool render_window = false, render_window_focus = false;
 
+    // Progressive mode restarts the render whenever the camera moves
+    bool progressive = false;
+    Camera preview_cam;
+
+    bool denoise = false;
+
     int method = 1;
-    bool animating = false, init = false;
+    bool animating = false;
     int next_frame = 0, max_frame = 0;
 
+    // Path traced animation frames in flight. The next frame's scene is built
+    // and traced while the previous one finishes, and finished frames are
+    // encoded in the background.
+    struct Frame {
+        PT::Pathtracer* tracer;
+        int index;
+        std::chrono::steady_clock::time_point start;
+    };
+    std::deque<Frame> frames;
+    std::deque<std::future<std::string>> frame_writes;
+    std::unique_ptr<PT::Pathtracer> frame_tracer;
+
     char output_path[256] = {};
     std::string folder;
 
+    // Per-frame stopping criteria (headless only)
+    float time_limit = 0.0f, target_noise = 0.0f;
+    std::chrono::steady_clock::time_point render_start;
+
     GL::MSAA msaa;
     PT::Pathtracer pathtracer;
 };
@@ -134,6 +134,11 @@ struct Mat4 {
         return *this;
     }
     Mat4 operator*(const Mat4& m) const {
+#ifdef CARDINAL3D_SIMD
+        Mat4 ret;
+        for(int i = 0; i < 4; i++) ret.cols[i] = *this * m.cols[i];
+        return ret;
+#else
         Mat4 ret;
         for(int i = 0; i < 4; i++) {
             for(int j = 0; j < 4; j++) {
@@ -144,10 +149,20 @@ struct Mat4 {
             }
         }
         return ret;
+#endif
     }
 
     Vec4 operator*(Vec4 v) const {
+#ifdef CARDINAL3D_SIMD
+        // Same order of operations as the scalar code
+        SIMD::F4 r = SIMD::mul(SIMD::splat(v[0]), cols[0].reg());
+        r = SIMD::add(r, SIMD::mul(SIMD::splat(v[1]), cols[1].reg()));
+        r = SIMD::add(r, SIMD::mul(SIMD::splat(v[2]), cols[2].reg()));
+        r = SIMD::add(r, SIMD::mul(SIMD::splat(v[3]), cols[3].reg()));
+        return Vec4(r);
+#else
         return v[0] * cols[0] + v[1] * cols[1] + v[2] * cols[2] + v[3] * cols[3];
+#endif
     }
 
     /// Expands v to Vec4(v, 1.0), multiplies, and projects back to 3D
@@ -284,6 +299,11 @@ inline Mat4 outer(Vec4 u, Vec4 v) {
 }
 
 inline Mat4 Mat4::transpose(const Mat4& m) {
+#ifdef CARDINAL3D_SIMD
+    SIMD::F4 a = m.cols[0].reg(), b = m.cols[1].reg(), c = m.cols[2].reg(), d = m.cols[3].reg();
+    SIMD::transpose(a, b, c, d);
+    return Mat4{Vec4{a}, Vec4{b}, Vec4{c}, Vec4{d}};
+#else
     Mat4 r;
     for(int i = 0; i < 4; i++) {
         for(int j = 0; j < 4; j++) {
@@ -291,9 +311,37 @@ inline Mat4 Mat4::transpose(const Mat4& m) {
         }
     }
     return r;
+#endif
 }
 
 inline Mat4 Mat4::inverse(const Mat4& m) {
+#ifdef CARDINAL3D_SIMD
+    // With columns (a, x), (b, y), (c, z), (d, w), the rows of the inverse
+    // follow from cross products of the 3D parts (Lengyel, Foundations of
+    // Game Engine Development vol. 1, 1.7.5). The w lanes of s, t, u and v
+    // are zero, so 4D dot products of them are 3D ones.
+    using namespace SIMD;
+    F4 a = m.cols[0].reg(), b = m.cols[1].reg(), c = m.cols[2].reg(), d = m.cols[3].reg();
+    F4 x = splat(m[0][3]), y = splat(m[1][3]), z = splat(m[2][3]), w = splat(m[3][3]);
+
+    F4 s = cross(a, b), t = cross(c, d);
+    F4 u = sub(mul(a, y), mul(b, x)), v = sub(mul(c, w), mul(d, z));
+
+    F4 inv_det = splat(1.0f / (sum(mul(s, v)) + sum(mul(t, u))));
+    s = mul(s, inv_det);
+    t = mul(t, inv_det);
+    u = mul(u, inv_det);
+    v = mul(v, inv_det);
+
+    F4 r0 = add(cross(b, v), mul(t, y));
+    F4 r1 = sub(cross(v, a), mul(t, x));
+    F4 r2 = add(cross(d, u), mul(s, w));
+    F4 r3 = sub(cross(u, c), mul(s, z));
+    SIMD::transpose(r0, r1, r2, r3);
+
+    F4 last = set(-sum(mul(b, t)), sum(mul(a, t)), -sum(mul(d, s)), sum(mul(c, s)));
+    return Mat4{Vec4{r0}, Vec4{r1}, Vec4{r2}, Vec4{last}};
+#else
     Mat4 r;
     r[0][0] = m[1][2] * m[2][3] * m[3][1] - m[1][3] * m[2][2] * m[3][1] +
               m[1][3] * m[2][1] * m[3][2] - m[1][1] * m[2][3] * m[3][2] -
@@ -345,6 +393,7 @@ inline Mat4 Mat4::inverse(const Mat4& m) {
               m[0][1] * m[1][0] * m[2][2] + m[0][0] * m[1][1] * m[2][2];
     r /= m.det();
     return r;
+#endif
 }
 
 inline Mat4 Mat4::rotate_to(Vec3 dir) {
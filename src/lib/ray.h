@@ -43,6 +43,10 @@ struct Ray {
     Spectrum throughput = Spectrum(1.0f);
     /// Recursive depth of ray
     size_t depth = 0;
+    /// Angular width (in radians) of the bundle of directions this ray stands for,
+    /// e.g. after sampling a rough BSDF. Prefiltered lookups such as environment
+    /// maps may blur over it; 0 asks for full detail.
+    float spread = 0.0f;
 
     /// The minimum and maximum distance at which this ray can encounter collisions
     /// note that this field is mutable, meaning it can be changed on const Rays
@@ -0,0 +1,152 @@
+#pragma once
+
+// Four float registers backing Vec4 and Mat4 when the build defines
+// CARDINAL3D_SIMD_MATH (see CMakeLists.txt) and the target has SSE or 64 bit
+// NEON. CARDINAL3D_SIMD is defined if they are in use; otherwise the math
+// types use their scalar code. Results agree with the scalar code up to
+// rounding; multiplies and adds are never fused.
+
+#ifdef CARDINAL3D_SIMD_MATH
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define CARDINAL3D_SIMD
+#define CARDINAL3D_SIMD_SSE
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define CARDINAL3D_SIMD
+#define CARDINAL3D_SIMD_NEON
+#endif
+#endif
+
+#ifdef CARDINAL3D_SIMD
+
+namespace SIMD {
+
+#ifdef CARDINAL3D_SIMD_SSE
+
+using F4 = __m128;
+
+inline F4 load(const float* p) {
+    return _mm_loadu_ps(p);
+}
+inline void store(float* p, F4 v) {
+    _mm_storeu_ps(p, v);
+}
+inline F4 splat(float f) {
+    return _mm_set1_ps(f);
+}
+inline F4 set(float x, float y, float z, float w) {
+    return _mm_setr_ps(x, y, z, w);
+}
+
+inline F4 add(F4 a, F4 b) {
+    return _mm_add_ps(a, b);
+}
+inline F4 sub(F4 a, F4 b) {
+    return _mm_sub_ps(a, b);
+}
+inline F4 mul(F4 a, F4 b) {
+    return _mm_mul_ps(a, b);
+}
+inline F4 div(F4 a, F4 b) {
+    return _mm_div_ps(a, b);
+}
+inline F4 min(F4 a, F4 b) {
+    return _mm_min_ps(a, b);
+}
+inline F4 max(F4 a, F4 b) {
+    return _mm_max_ps(a, b);
+}
+
+/// Lanes (y, z, x, w) and (z, x, y, w), for cross products
+inline F4 yzx(F4 v) {
+    return _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 0, 2, 1));
+}
+inline F4 zxy(F4 v) {
+    return _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 1, 0, 2));
+}
+
+/// Sum of the lanes, added as ((x + y) + z) + w
+inline float sum(F4 v) {
+    float f[4];
+    _mm_storeu_ps(f, v);
+    return ((f[0] + f[1]) + f[2]) + f[3];
+}
+
+/// Registers a, b, c, d become the columns of the matrix they were the rows of
+inline void transpose(F4& a, F4& b, F4& c, F4& d) {
+    _MM_TRANSPOSE4_PS(a, b, c, d);
+}
+
+#else
+
+using F4 = float32x4_t;
+
+inline F4 load(const float* p) {
+    return vld1q_f32(p);
+}
+inline void store(float* p, F4 v) {
+    vst1q_f32(p, v);
+}
+inline F4 splat(float f) {
+    return vdupq_n_f32(f);
+}
+inline F4 set(float x, float y, float z, float w) {
+    float f[4] = {x, y, z, w};
+    return vld1q_f32(f);
+}
+
+inline F4 add(F4 a, F4 b) {
+    return vaddq_f32(a, b);
+}
+inline F4 sub(F4 a, F4 b) {
+    return vsubq_f32(a, b);
+}
+inline F4 mul(F4 a, F4 b) {
+    return vmulq_f32(a, b);
+}
+inline F4 div(F4 a, F4 b) {
+    return vdivq_f32(a, b);
+}
+inline F4 min(F4 a, F4 b) {
+    return vminq_f32(a, b);
+}
+inline F4 max(F4 a, F4 b) {
+    return vmaxq_f32(a, b);
+}
+
+/// Lanes (y, z, x, w) and (z, x, y, w), for cross products
+inline F4 yzx(F4 v) {
+    F4 yzwx = vextq_f32(v, v, 1);
+    yzwx = vsetq_lane_f32(vgetq_lane_f32(v, 0), yzwx, 2);
+    return vsetq_lane_f32(vgetq_lane_f32(v, 3), yzwx, 3);
+}
+inline F4 zxy(F4 v) {
+    return yzx(yzx(v));
+}
+
+/// Sum of the lanes, added as ((x + y) + z) + w
+inline float sum(F4 v) {
+    return ((vgetq_lane_f32(v, 0) + vgetq_lane_f32(v, 1)) + vgetq_lane_f32(v, 2)) +
+           vgetq_lane_f32(v, 3);
+}
+
+/// Registers a, b, c, d become the columns of the matrix they were the rows of
+inline void transpose(F4& a, F4& b, F4& c, F4& d) {
+    float32x4x2_t ab = vtrnq_f32(a, b), cd = vtrnq_f32(c, d);
+    a = vcombine_f32(vget_low_f32(ab.val[0]), vget_low_f32(cd.val[0]));
+    b = vcombine_f32(vget_low_f32(ab.val[1]), vget_low_f32(cd.val[1]));
+    c = vcombine_f32(vget_high_f32(ab.val[0]), vget_high_f32(cd.val[0]));
+    d = vcombine_f32(vget_high_f32(ab.val[1]), vget_high_f32(cd.val[1]));
+}
+
+#endif
+
+/// Cross product of the xyz lanes; the w lane is zero
+inline F4 cross(F4 a, F4 b) {
+    return sub(mul(yzx(a), zxy(b)), mul(zxy(a), yzx(b)));
+}
+
+} // namespace SIMD
+
+#endif
@@ -6,6 +6,7 @@
 #include <ostream>
 
 #include "log.h"
+#include "simd.h"
 #include "vec3.h"
 
 struct Vec4 {
@@ -37,6 +38,14 @@ struct Vec4 {
         z = xyz.z;
         w = _w;
     }
+#ifdef CARDINAL3D_SIMD
+    explicit Vec4(SIMD::F4 v) {
+        SIMD::store(data, v);
+    }
+    SIMD::F4 reg() const {
+        return SIMD::load(data);
+    }
+#endif
 
     Vec4(const Vec4&) = default;
     Vec4& operator=(const Vec4&) = default;
@@ -52,87 +61,87 @@ struct Vec4 {
     }
 
     Vec4 operator+=(Vec4 v) {
-        x += v.x;
-        y += v.y;
-        z += v.z;
-        w += v.w;
-        return *this;
+        return *this = *this + v;
     }
     Vec4 operator-=(Vec4 v) {
-        x -= v.x;
-        y -= v.y;
-        z -= v.z;
-        w -= v.w;
-        return *this;
+        return *this = *this - v;
     }
     Vec4 operator*=(Vec4 v) {
-        x *= v.x;
-        y *= v.y;
-        z *= v.z;
-        w *= v.w;
-        return *this;
+        return *this = *this * v;
     }
     Vec4 operator/=(Vec4 v) {
-        x /= v.x;
-        y /= v.y;
-        z /= v.z;
-        w /= v.w;
-        return *this;
+        return *this = *this / v;
     }
 
     Vec4 operator+=(float s) {
-        x += s;
-        y += s;
-        z += s;
-        w += s;
-        return *this;
+        return *this = *this + s;
     }
     Vec4 operator-=(float s) {
-        x -= s;
-        y -= s;
-        z -= s;
-        w -= s;
-        return *this;
+        return *this = *this - s;
     }
     Vec4 operator*=(float s) {
-        x *= s;
-        y *= s;
-        z *= s;
-        w *= s;
-        return *this;
+        return *this = *this * s;
     }
     Vec4 operator/=(float s) {
-        x /= s;
-        y /= s;
-        z /= s;
-        w /= s;
-        return *this;
+        return *this = *this / s;
     }
 
     Vec4 operator+(Vec4 v) const {
+#ifdef CARDINAL3D_SIMD
+        return Vec4(SIMD::add(reg(), v.reg()));
+#else
         return Vec4(x + v.x, y + v.y, z + v.z, w + v.w);
+#endif
     }
     Vec4 operator-(Vec4 v) const {
+#ifdef CARDINAL3D_SIMD
+        return Vec4(SIMD::sub(reg(), v.reg()));
+#else
         return Vec4(x - v.x, y - v.y, z - v.z, w - v.w);
+#endif
     }
     Vec4 operator*(Vec4 v) const {
+#ifdef CARDINAL3D_SIMD
+        return Vec4(SIMD::mul(reg(), v.reg()));
+#else
         return Vec4(x * v.x, y * v.y, z * v.z, w * v.w);
+#endif
     }
     Vec4 operator/(Vec4 v) const {
+#ifdef CARDINAL3D_SIMD
+        return Vec4(SIMD::div(reg(), v.reg()));
+#else
         return Vec4(x / v.x, y / v.y, z / v.z, w / v.w);
+#endif
     }
 
     Vec4 operator+(float s) const {
+#ifdef CARDINAL3D_SIMD
+        return Vec4(SIMD::add(reg(), SIMD::splat(s)));
+#else
         return Vec4(x + s, y + s, z + s, w + s);
+#endif
     }
     Vec4 operator-(float s) const {
+#ifdef CARDINAL3D_SIMD
+        return Vec4(SIMD::sub(reg(), SIMD::splat(s)));
+#else
         return Vec4(x - s, y - s, z - s, w - s);
+#endif
     }
     Vec4 operator*(float s) const {
+#ifdef CARDINAL3D_SIMD
+        return Vec4(SIMD::mul(reg(), SIMD::splat(s)));
+#else
         return Vec4(x * s, y * s, z * s, w * s);
+#endif
     }
     Vec4 operator/(float s) const {
+#ifdef CARDINAL3D_SIMD
+        return Vec4(SIMD::div(reg(), SIMD::splat(s)));
+#else
         return Vec4(x / s, y / s, z / s, w / s);
+#endif
     }
 
     bool operator==(Vec4 v) const {
@@ -199,30 +208,42 @@ struct Vec4 {
 };
 
 inline Vec4 operator+(float s, Vec4 v) {
-    return Vec4(v.x + s, v.y + s, v.z + s, v.w + s);
+    return v + s;
 }
 inline Vec4 operator-(float s, Vec4 v) {
-    return Vec4(v.x - s, v.y - s, v.z - s, v.w - s);
+    return v - s;
 }
 inline Vec4 operator*(float s, Vec4 v) {
-    return Vec4(v.x * s, v.y * s, v.z * s, v.w * s);
+    return v * s;
 }
 inline Vec4 operator/(float s, Vec4 v) {
-    return Vec4(s / v.x, s / v.y, s / v.z, s / v.w);
+    return Vec4(s) / v;
 }
 
 /// Take minimum of each component
 inline Vec4 hmin(Vec4 l, Vec4 r) {
+#ifdef CARDINAL3D_SIMD
+    return Vec4(SIMD::min(l.reg(), r.reg()));
+#else
     return Vec4(std::min(l.x, r.x), std::min(l.y, r.y), std::min(l.z, r.z), std::min(l.w, r.w));
+#endif
 }
 /// Take maximum of each component
 inline Vec4 hmax(Vec4 l, Vec4 r) {
+#ifdef CARDINAL3D_SIMD
+    return Vec4(SIMD::max(l.reg(), r.reg()));
+#else
     return Vec4(std::max(l.x, r.x), std::max(l.y, r.y), std::max(l.z, r.z), std::max(l.w, r.w));
+#endif
 }
 
 /// 4D dot product
 inline float dot(Vec4 l, Vec4 r) {
+#ifdef CARDINAL3D_SIMD
+    return SIMD::sum(SIMD::mul(l.reg(), r.reg()));
+#else
     return l.x * r.x + l.y * r.y + l.z * r.z + l.w * r.w;
+#endif
 }
 
 inline std::ostream& operator<<(std::ostream& out, Vec4 v) {
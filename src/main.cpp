@@ -1,7 +1,135 @@
 
 #include "platform/platform.h"
+#include "rays/pathtracer.h"
 #include "util/rand.h"
 #include <sf_libs/CLI11.hpp>
+#include <sf_libs/stb_image_write.h>
+
+#include <fstream>
+
+static int merge(const std::vector<std::string>& partials, std::string output, float exposure) {
+
+    HDR_Image image;
+    std::string err = PT::Pathtracer::merge_partials(partials, image);
+    if(!err.empty()) {
+        warn("Error merging renders: %s", err.c_str());
+        return 1;
+    }
+
+    auto [w, h] = image.dimension();
+    std::vector<unsigned char> data;
+    image.tonemap_to(data, exposure);
+    if(!stbi_write_png(output.c_str(), (int)w, (int)h, 4, data.data(), (int)w * 4)) {
+        warn("Error merging renders: Failed to write output!");
+        return 1;
+    }
+    return 0;
+}
+
+// Options shared by the command line and each line of a batch job file
+static void add_render_options(CLI::App& args, App::Settings& settings) {
+
+    args.add_option("-s,--scene", settings.scene_file, "Scene file to load");
+    args.add_option("--env_map", settings.env_map_file, "Override scene environment map");
+
+    Gui::Headless_Opts& render = settings.render;
+    args.add_option("-o,--output", render.output,
+                    "Image file to write, linear if it ends in .exr (if headless)");
+    args.add_flag("--aovs", render.aovs,
+                  "Add depth, normal, albedo and object id channels to EXR output (if headless)");
+    args.add_flag("--denoise", render.denoise,
+                  "Filter the output with an edge-aware denoiser, which allows far fewer "
+                  "samples (if headless)");
+    args.add_flag("--animate", render.animate, "Output animation frames (if headless)");
+    args.add_option("--width", render.w, "Output image width (if headless)");
+    args.add_option("--height", render.h, "Output image height (if headless)");
+    args.add_flag("--use_ar", render.w_from_ar,
+                  "Compute output image width based on camera AR (if headless)");
+    args.add_option("--depth", render.d, "Maximum ray depth (if headless)");
+    args.add_option("--samples", render.s, "Pixel samples (if headless)");
+    args.add_option("--exposure", render.exp, "Output exposure (if headless)");
+    args.add_option("--area_samples", render.ls, "Area light samples (if headless)");
+    args.add_option("--light_sampling", render.lm,
+                    "Light selection: all, power or tree (if headless)")
+        ->transform(CLI::CheckedTransformer(
+            std::map<std::string, int>{{"all", 0}, {"power", 1}, {"tree", 2}}, CLI::ignore_case));
+    args.add_option("--light_samples", render.nl,
+                    "Lights sampled per hit with power or tree selection (if headless)");
+    args.add_option("--integrator", render.in, "Integrator: path or mis (if headless)")
+        ->transform(CLI::CheckedTransformer(std::map<std::string, int>{{"path", 0}, {"mis", 1}},
+                                            CLI::ignore_case));
+    args.add_option("--env_format", render.ef,
+                    "Environment map storage: float, half or rgbe (if headless)")
+        ->transform(CLI::CheckedTransformer(
+            std::map<std::string, int>{{"float", 0}, {"half", 1}, {"rgbe", 2}}, CLI::ignore_case));
+    args.add_option("--checkpoint", render.checkpoint,
+                    "Periodically save render progress to this file (if headless)");
+    args.add_option("--checkpoint_interval", render.checkpoint_interval,
+                    "Seconds between checkpoints (if headless)");
+    args.add_option("--resume", render.resume,
+                    "Continue the render saved in this checkpoint, if it exists (if headless)");
+    args.add_option("--shard", render.shard,
+                    "Index of the part of the render to trace (if headless)");
+    args.add_option("--shards", render.shards,
+                    "Split the render into this many parts, each written as a partial render "
+                    "to --output (if headless)");
+    args.add_option("--shard_by", render.shard_by, "Split by rows or samples (if headless)")
+        ->transform(CLI::CheckedTransformer(
+            std::map<std::string, int>{{"rows", 0}, {"samples", 1}}, CLI::ignore_case));
+    args.add_option("--seed", render.seed,
+                    "Seed of the random samples; shards and resumed renders must use the same "
+                    "one (if headless)");
+
+    args.add_option("--time_limit,--time-limit", render.time_limit,
+                    "Stop after this many seconds and write the samples so far (if headless)");
+    args.add_option("--target_noise,--target-noise", render.target_noise,
+                    "Stop once the estimated relative error of the image is below this "
+                    "(if headless)");
+    args.add_option("--stream_rows", render.stream_rows,
+                    "Trace this many rows at a time and write each band to the EXR output as "
+                    "it finishes, so memory use doesn't grow with image height (if headless)");
+
+    args.add_option("--camera_pos", render.cam_pos, "Override the camera position (if headless)")
+        ->expected(3);
+    args.add_option("--camera_center", render.cam_center,
+                    "Override the point the camera looks at (if headless)")
+        ->expected(3);
+    args.add_option("--fov", render.fov, "Override the vertical field of view (if headless)");
+    args.add_option("--orbit", render.orbit,
+                    "Rotate the camera this many degrees about the vertical axis through its "
+                    "center, e.g. for turntables (if headless)");
+}
+
+// Each non-empty line of the job file holds the options of one render, on
+// top of the options given on the command line
+static bool read_jobs(std::string file, const App::Settings& defaults,
+                      std::vector<App::Job>& jobs) {
+
+    std::ifstream in(file);
+    if(!in.good()) {
+        warn("Error reading job file %s", file.c_str());
+        return false;
+    }
+
+    std::string line;
+    for(size_t n = 1; std::getline(in, line); n++) {
+
+        size_t start = line.find_first_not_of(" \t\r");
+        if(start == std::string::npos || line[start] == '#') continue;
+
+        App::Settings job = defaults;
+        CLI::App job_args{"Batch job"};
+        add_render_options(job_args, job);
+        try {
+            job_args.parse(line);
+        } catch(const CLI::ParseError& e) {
+            warn("Error in %s line %zu: %s", file.c_str(), n, e.what());
+            return false;
+        }
+        jobs.push_back({job.scene_file, job.env_map_file, job.render});
+    }
+    return true;
+}
 
 int main(int argc, char** argv) {
 
@@ -10,22 +138,40 @@ int main(int argc, char** argv) {
     App::Settings settings;
     CLI::App args{"Cardinal3D - CS248"};
 
-    args.add_option("-s,--scene", settings.scene_file, "Scene file to load");
-    args.add_option("--env_map", settings.env_map_file, "Override scene environment map");
+    add_render_options(args, settings);
     args.add_flag("--headless", settings.headless, "Path-trace scene without opening the GUI");
-    args.add_option("-o,--output", settings.output_file, "Image file to write (if headless)");
-    args.add_flag("--animate", settings.animate, "Output animation frames (if headless)");
-    args.add_option("--width", settings.w, "Output image width (if headless)");
-    args.add_option("--height", settings.h, "Output image height (if headless)");
-    args.add_flag("--use_ar", settings.w_from_ar,
-                  "Compute output image width based on camera AR (if headless)");
-    args.add_option("--depth", settings.d, "Maximum ray depth (if headless)");
-    args.add_option("--samples", settings.s, "Pixel samples (if headless)");
-    args.add_option("--exposure", settings.exp, "Output exposure (if headless)");
-    args.add_option("--area_samples", settings.ls, "Area light samples (if headless)");
+
+    std::string batch_file;
+    args.add_option("--batch", batch_file,
+                    "Render each line of this job file in one process, reusing scenes "
+                    "between jobs (implies headless)");
+
+    size_t threads = 0;
+    int first_cpu = -1;
+    args.add_option("--threads", threads, "Worker threads, 0 for one per hardware thread");
+    args.add_option("--pin_threads", first_cpu,
+                    "Pin worker i to CPU n + i, e.g. to run several renders per node");
+
+    std::vector<std::string> partials;
+    std::string merge_output = "out.png";
+    float merge_exposure = 1.0f;
+    CLI::App* merge_cmd =
+        args.add_subcommand("merge", "Combine partial renders written with --shards");
+    merge_cmd->add_option("partials", partials, "Partial render files")->required();
+    merge_cmd->add_option("-o,--output", merge_output, "Image file to write");
+    merge_cmd->add_option("--exposure", merge_exposure, "Output exposure");
 
     CLI11_PARSE(args, argc, argv);
 
+    if(*merge_cmd) return merge(partials, merge_output, merge_exposure);
+
+    Thread_Pool::configure(threads, first_cpu);
+
+    if(!batch_file.empty()) {
+        if(!read_jobs(batch_file, settings, settings.batch)) return 1;
+        settings.headless = true;
+    }
+
     if(!settings.headless) {
         Platform plt;
         App app(settings, &plt);
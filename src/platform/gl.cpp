@@ -160,6 +160,13 @@ void Tex2D::image(int w, int h, unsigned char* img) {
     glBindTexture(GL_TEXTURE_2D, 0);
 }
 
+void Tex2D::sub_image(int x, int y, int w, int h, unsigned char* img) {
+    assert(id);
+    glBindTexture(GL_TEXTURE_2D, id);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, img);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
 TexID Tex2D::get_id() const {
     return id;
 }
@@ -49,6 +49,8 @@ public:
     void operator=(Tex2D&& src);
 
     void image(int w, int h, unsigned char* img);
+    // Replace a w x h region of the existing image at (x, y)
+    void sub_image(int x, int y, int w, int h, unsigned char* img);
     TexID get_id() const;
     void bind(int idx = 0) const;
 
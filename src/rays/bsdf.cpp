@@ -0,0 +1,29 @@
+#include "bsdf.h"
+
+namespace PT {
+
+// Only the MIS integrator uses these. The diffuse BSDFs report the density of
+// their sampler, which matches sample() as long as it draws from that sampler.
+// The rest are discrete, so no direction has a density.
+
+float BSDF_Lambertian::pdf(Vec3, Vec3 in_dir) const {
+    return sampler.pdf(in_dir);
+}
+
+float BSDF_Diffuse::pdf(Vec3, Vec3 in_dir) const {
+    return sampler.pdf(in_dir);
+}
+
+float BSDF_Mirror::pdf(Vec3, Vec3) const {
+    return 0.0f;
+}
+
+float BSDF_Refract::pdf(Vec3, Vec3) const {
+    return 0.0f;
+}
+
+float BSDF_Glass::pdf(Vec3, Vec3) const {
+    return 0.0f;
+}
+
+} // namespace PT
@@ -0,0 +1,141 @@
+
+#include "denoise.h"
+
+#include <cmath>
+#include <limits>
+
+namespace PT {
+
+namespace {
+
+// Planar buffers, so each pass streams through contiguous floats
+struct Planes {
+    explicit Planes(size_t n) : r(n), g(n), b(n), var(n) {
+    }
+    float luma(size_t i) const {
+        return 0.2126f * r[i] + 0.7152f * g[i] + 0.0722f * b[i];
+    }
+    std::vector<float> r, g, b, var;
+};
+
+} // namespace
+
+void denoise(const HDR_Image& in, HDR_Image& out, const Denoise_Guides& guides,
+             Thread_Pool& pool, size_t passes) {
+
+    static const float kernel[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f,
+                                    1.0f / 16.0f};
+    static const float sigma_luma = 4.0f, sigma_depth = 1.0f;
+    static const float min_albedo = 0.01f;
+    static const size_t band = 16;
+    static const float inf = std::numeric_limits<float>::infinity();
+
+    auto [w, h] = in.dimension();
+    size_t n = w * h;
+    bool use_variance = guides.variance.size() == n;
+
+    const std::vector<float>& depth = guides.depth;
+    const std::vector<Vec3>& normal = guides.normal;
+
+    // Dividing out the albedo leaves the (smoother) incident lighting
+    std::vector<Spectrum> albedo(n);
+    Planes cur(n), next(n);
+    for(size_t i = 0; i < n; i++) {
+        Spectrum a = guides.albedo[i];
+        a.r = a.r > min_albedo ? a.r : 1.0f;
+        a.g = a.g > min_albedo ? a.g : 1.0f;
+        a.b = a.b > min_albedo ? a.b : 1.0f;
+        albedo[i] = a;
+
+        Spectrum c = in.at(i);
+        cur.r[i] = c.r / a.r;
+        cur.g[i] = c.g / a.g;
+        cur.b[i] = c.b / a.b;
+        float l = a.luma();
+        cur.var[i] = use_variance ? guides.variance[i] / (l * l) : 0.0f;
+    }
+
+    // Depth change per pixel along the surface, so surfaces seen at grazing
+    // angles are not mistaken for depth edges. Taking the smaller one-sided
+    // difference on each axis keeps real edges from inflating it.
+    std::vector<float> slope(n, 0.0f);
+    for(size_t j = 0; j < h; j++) {
+        for(size_t i = 0; i < w; i++) {
+            size_t p = j * w + i;
+            if(!std::isfinite(depth[p])) continue;
+            auto diff = [&](bool inside, size_t q) {
+                if(!inside || !std::isfinite(depth[q])) return inf;
+                return std::abs(depth[p] - depth[q]);
+            };
+            float sx = std::min(diff(i > 0, p - 1), diff(i + 1 < w, p + 1));
+            float sy = std::min(diff(j > 0, p - w), diff(j + 1 < h, p + w));
+            if(std::isfinite(sx)) slope[p] = std::max(slope[p], sx);
+            if(std::isfinite(sy)) slope[p] = std::max(slope[p], sy);
+        }
+    }
+
+    auto filter = [&](size_t row_begin, size_t row_end, long step) {
+        for(size_t j = row_begin; j < row_end; j++) {
+            for(size_t i = 0; i < w; i++) {
+
+                size_t p = j * w + i;
+                float zp = depth[p], lp = cur.luma(p);
+                Vec3 np = normal[p];
+                bool miss = !std::isfinite(zp);
+                float luma_scale =
+                    use_variance ? 1.0f / (sigma_luma * std::sqrt(cur.var[p]) + 1e-4f) : 0.0f;
+                float depth_scale = miss ? 0.0f : sigma_depth * slope[p] * step + 1e-3f * zp;
+
+                float sr = 0.0f, sg = 0.0f, sb = 0.0f, sv = 0.0f, sw = 0.0f;
+                for(long dy = -2; dy <= 2; dy++) {
+                    long y = (long)j + dy * step;
+                    if(y < 0 || y >= (long)h) continue;
+                    for(long dx = -2; dx <= 2; dx++) {
+                        long x = (long)i + dx * step;
+                        if(x < 0 || x >= (long)w) continue;
+
+                        size_t q = (size_t)y * w + (size_t)x;
+                        float wq = kernel[dx + 2] * kernel[dy + 2];
+                        if(q != p) {
+                            if(miss != !std::isfinite(depth[q])) continue;
+                            float e = std::abs(lp - cur.luma(q)) * luma_scale;
+                            if(!miss) {
+                                // max(n.n', 0)^128
+                                float c = std::max(dot(np, normal[q]), 0.0f);
+                                for(int k = 0; k < 7; k++) c *= c;
+                                float dist = (float)std::max(std::abs(dx), std::abs(dy));
+                                e += std::abs(zp - depth[q]) / (depth_scale * dist + 1e-6f);
+                                wq *= c;
+                            }
+                            wq *= std::exp(-e);
+                        }
+                        sr += wq * cur.r[q];
+                        sg += wq * cur.g[q];
+                        sb += wq * cur.b[q];
+                        sv += wq * wq * cur.var[q];
+                        sw += wq;
+                    }
+                }
+                // The center tap always contributes, so sw > 0
+                float inv = 1.0f / sw;
+                next.r[p] = sr * inv;
+                next.g[p] = sg * inv;
+                next.b[p] = sb * inv;
+                next.var[p] = sv * inv * inv;
+            }
+        }
+    };
+
+    for(size_t pass = 0; pass < passes; pass++) {
+        long step = 1l << pass;
+        pool.parallel_for(0, h, band, [&](size_t begin, size_t end) { filter(begin, end, step); });
+        std::swap(cur, next);
+    }
+
+    out.resize(w, h);
+    for(size_t i = 0; i < n; i++) {
+        out.at(i) = Spectrum(cur.r[i], cur.g[i], cur.b[i]) * albedo[i];
+    }
+}
+
+} // namespace PT
@@ -0,0 +1,30 @@
+
+#pragma once
+
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../util/hdr_image.h"
+#include "../util/thread_pool.h"
+
+namespace PT {
+
+// Per-pixel inputs of the denoiser, in the same order as the image pixels
+struct Denoise_Guides {
+    const std::vector<Vec3>& normal;
+    const std::vector<float>& depth; // infinity where the camera ray missed
+    const std::vector<Spectrum>& albedo;
+    // Luma variance of each pixel's mean, or empty if unknown
+    const std::vector<float>& variance;
+};
+
+// Edge-avoiding A-Trous wavelet filter (Dammertz et al. 2010). Each pass
+// applies a 5x5 B3-spline kernel with twice the spacing of the last, with
+// taps weighted down across changes in normal and depth, and by luma
+// differences relative to the pixel's noise (as in SVGF). Lighting is
+// filtered with the albedo divided out, so texture detail is kept.
+// Bands of rows are filtered in parallel on the pool.
+void denoise(const HDR_Image& in, HDR_Image& out, const Denoise_Guides& guides,
+             Thread_Pool& pool, size_t passes = 5);
+
+} // namespace PT
@@ -0,0 +1,148 @@
+#include "env_light.h"
+#include "../util/thread_pool.h"
+
+#include <limits>
+
+namespace PT {
+
+namespace {
+
+// Box filtered copy of an equirectangular image at half the size. With an odd
+// size, the last texel of each row or column averages three source texels.
+HDR_Image half_size(const HDR_Image& image) {
+
+    size_t w, h;
+    std::tie(w, h) = image.dimension();
+    size_t hw = std::max(w / 2, size_t(1)), hh = std::max(h / 2, size_t(1));
+
+    std::vector<Spectrum> texels(hw * hh);
+    Thread_Pool::get().parallel_for(0, hh, 16, [&](size_t begin, size_t end) {
+        for(size_t j = begin; j < end; j++) {
+            size_t y0 = j * h / hh, y1 = (j + 1) * h / hh;
+            for(size_t i = 0; i < hw; i++) {
+                size_t x0 = i * w / hw, x1 = (i + 1) * w / hw;
+                Spectrum sum;
+                for(size_t y = y0; y < y1; y++) {
+                    for(size_t x = x0; x < x1; x++) sum += image.at(x, y);
+                }
+                texels[j * hw + i] = sum * (1.0f / ((x1 - x0) * (y1 - y0)));
+            }
+        }
+    });
+
+    HDR_Image half(hw, hh);
+    for(size_t i = 0; i < texels.size(); i++) half.at(i) = texels[i];
+    return half;
+}
+
+// Bilinear interpolation between the four nearest texel centers, wrapping
+// around in longitude and clamping at the poles
+Spectrum bilinear(const Packed_Image& image, Vec2 uv) {
+
+    const auto [w, h] = image.dimension();
+    float x = uv.x * w - 0.5f, y = clamp(uv.y * h - 0.5f, 0.0f, (float)(h - 1));
+    float fx = std::floor(x), fy = std::floor(y);
+    float tx = x - fx, ty = y - fy;
+
+    size_t x0 = (size_t)(((long long)fx % (long long)w + (long long)w) % (long long)w);
+    size_t x1 = (x0 + 1) % w;
+    size_t y0 = (size_t)fy, y1 = std::min(y0 + 1, h - 1);
+
+    Spectrum bottom = image.at(x0, y0) * (1.0f - tx) + image.at(x1, y0) * tx;
+    Spectrum top = image.at(x0, y1) * (1.0f - tx) + image.at(x1, y1) * tx;
+    return bottom * (1.0f - ty) + top * ty;
+}
+
+// Power of an equirectangular map: its average radiance over the sphere, where
+// each row covers a band of solid angle proportional to sin(theta), times 4pi
+Spectrum sphere_power(const HDR_Image& image) {
+
+    const auto [w, h] = image.dimension();
+    Spectrum total;
+    float weight = 0.0f;
+    for(size_t j = 0; j < h; j++) {
+        float sin_theta = std::sin(PI_F * (j + 0.5f) / h);
+        Spectrum row;
+        for(size_t i = 0; i < w; i++) row += image.at(i, j);
+        total += row * sin_theta;
+        weight += sin_theta * w;
+    }
+    if(weight <= 0.0f) return {};
+    return total * (4.0f * PI_F / weight);
+}
+
+} // namespace
+
+Env_Map::Env_Map(HDR_Image&& img, Pixel_Format format) : id(img.content_id()) {
+
+    // Each level is filtered from the full precision one before it, so
+    // rounding in the stored format doesn't build up
+    HDR_Image level = std::move(img);
+    bool sampled = false;
+    for(;;) {
+        levels.emplace_back(level, format);
+        const auto [w, h] = level.dimension();
+        if(!sampled && w <= max_table_width) {
+            importance = Samplers::Sphere::Alias_Image(level);
+            total_power = sphere_power(level);
+            sampled = true;
+        }
+        if(w <= 1 && h <= 1) break;
+        level = half_size(level);
+    }
+}
+
+Light_Sample Env_Map::sample_importance(float spread) const {
+
+    Light_Sample ret;
+    ret.distance = std::numeric_limits<float>::infinity();
+
+    ret.direction = importance.sample(ret.pdf);
+    ret.radiance = lookup(ret.direction, spread);
+    return ret;
+}
+
+Spectrum Env_Map::lookup(Vec3 dir, float spread) const {
+
+    const auto [w, h] = levels[0].dimension();
+    if(w == 0 || h == 0) return {};
+
+    Vec2 uv = Samplers::Sphere::Alias_Image::dir_to_uv(dir);
+    if(spread <= 0.0f) return bilinear(levels[0], uv);
+
+    // Texels of level l are about 2^l * 2pi / w radians wide at the equator
+    float level = std::log2(spread * w / (2.0f * PI_F));
+    level = clamp(level, 0.0f, (float)(levels.size() - 1));
+    size_t l = (size_t)level;
+    float t = level - l;
+
+    Spectrum fine = bilinear(levels[l], uv);
+    if(t <= 0.0f) return fine;
+    return fine * (1.0f - t) + bilinear(levels[l + 1], uv) * t;
+}
+
+float Env_Map::pdf(Vec3 dir) const {
+    return importance.pdf(dir);
+}
+
+Spectrum Env_Map::power() const {
+    return total_power;
+}
+
+Spectrum Env_Hemisphere::power() const {
+    return 2.0f * PI_F * radiance;
+}
+
+float Env_Hemisphere::pdf(Vec3 dir) const {
+    return sampler.pdf(dir);
+}
+
+Spectrum Env_Sphere::power() const {
+    return 4.0f * PI_F * radiance;
+}
+
+float Env_Sphere::pdf(Vec3 dir) const {
+    return sampler.pdf(dir);
+}
+
+} // namespace PT
@@ -6,6 +6,7 @@
 #include "../lib/mathlib.h"
 #include "../lib/spectrum.h"
 #include "../util/hdr_image.h"
+#include "../util/packed_image.h"
 
 #include "light.h"
 #include "samplers.h"
@@ -19,6 +20,8 @@ struct Env_Hemisphere {
 
     Light_Sample sample() const;
     Spectrum sample_direction(Vec3 dir) const;
+    Spectrum power() const;
+    float pdf(Vec3 dir) const;
 
     Spectrum radiance;
     Samplers::Hemisphere::Uniform sampler;
@@ -31,6 +34,8 @@ struct Env_Sphere {
 
     Light_Sample sample() const;
     Spectrum sample_direction(Vec3 dir) const;
+    Spectrum power() const;
+    float pdf(Vec3 dir) const;
 
     Spectrum radiance;
     Samplers::Sphere::Uniform sampler;
@@ -38,14 +43,36 @@ struct Env_Sphere {
 
 struct Env_Map {
 
-    Env_Map(HDR_Image&& img) : image(std::move(img)), sampler(image) {
-    }
+    // Importance sampling tables are built from the first level of the
+    // pyramid no wider than this
+    static const size_t max_table_width = 1024;
+
+    // Lookups read tiled copies of the image and of a box filtered mip
+    // pyramid of it, all in the given format
+    Env_Map(HDR_Image&& img, Pixel_Format format = Pixel_Format::rgb32f);
 
+    // Task 7 (student/env_light.cpp). Env_Light doesn't call these, and no
+    // Samplers::Sphere::Image is built for them.
     Light_Sample sample() const;
     Spectrum sample_direction(Vec3 dir) const;
 
-    HDR_Image image;
-    Samplers::Sphere::Image sampler;
+    // What Env_Light renders with (rays/env_light.cpp). sample_importance draws
+    // directions from the alias tables and looks them up with the given
+    // spread. lookup gives the radiance from dir,
+    // averaged over roughly spread radians around it by blending the two
+    // pyramid levels with texels of about that width; a spread of zero
+    // reads the full resolution image.
+    Light_Sample sample_importance(float spread = 0.0f) const;
+    Spectrum lookup(Vec3 dir, float spread = 0.0f) const;
+    Spectrum power() const;
+    float pdf(Vec3 dir) const;
+
+    uint64_t id;
+    // Level 0 is the image; each next level is half as large, down to 1x1
+    std::vector<Packed_Image> levels;
+    Samplers::Sphere::Alias_Image importance;
+    // Measured once, on the level the alias tables are built from
+    Spectrum total_power;
 };
 
 class Env_Light {
@@ -62,21 +89,47 @@ public:
     Env_Light& operator=(Env_Light&& src) = default;
     Env_Light(Env_Light&& src) = default;
 
-    Light_Sample sample(Vec3) const {
-        return std::visit(overloaded{[](const Env_Hemisphere& h) { return h.sample(); },
-                                     [](const Env_Sphere& h) { return h.sample(); },
-                                     [](const Env_Map& h) { return h.sample(); }},
-                          underlying);
+    // Radiance of the sample is read as sample_direction(dir, spread) would
+    Light_Sample sample(Vec3, float spread = 0.0f) const {
+        return std::visit(
+            overloaded{[](const Env_Hemisphere& h) { return h.sample(); },
+                       [](const Env_Sphere& h) { return h.sample(); },
+                       [spread](const Env_Map& h) { return h.sample_importance(spread); }},
+            underlying);
     }
 
-    Spectrum sample_direction(Vec3 dir) const {
+    // Spread is the angular width of the ray's footprint (see Ray::spread)
+    Spectrum sample_direction(Vec3 dir, float spread = 0.0f) const {
         return std::visit(
             overloaded{[&dir](const Env_Hemisphere& h) { return h.sample_direction(dir); },
                        [&dir](const Env_Sphere& h) { return h.sample_direction(dir); },
-                       [&dir](const Env_Map& h) { return h.sample_direction(dir); }},
+                       [&dir, spread](const Env_Map& h) { return h.lookup(dir, spread); }},
             underlying);
     }
 
+    // Solid angle density with which sample() picks dir
+    float pdf(Vec3 dir) const {
+        return std::visit(overloaded{[&dir](const auto& h) { return h.pdf(dir); }}, underlying);
+    }
+
+    // Radiance integrated over all directions
+    Spectrum power() const {
+        return std::visit(overloaded{[](const auto& h) { return h.power(); }}, underlying);
+    }
+
+    // Identifies the source image of an Env_Map, so it is only reprocessed
+    // when the image changes. Zero for other environment lights.
+    uint64_t map_id() const {
+        if(const Env_Map* map = std::get_if<Env_Map>(&underlying)) return map->id;
+        return 0;
+    }
+    Pixel_Format map_format() const {
+        if(const Env_Map* map = std::get_if<Env_Map>(&underlying)) {
+            return map->levels[0].format();
+        }
+        return Pixel_Format::rgb32f;
+    }
+
     bool is_discrete() const {
         return false;
     }
@@ -1,5 +1,6 @@
 
 #include "light.h"
+#include "../util/rand.h"
 
 namespace PT {
 
@@ -51,4 +52,170 @@ Light_Sample Rect_Light::sample(Vec3 from) const {
     return ret;
 }
 
+// Converts an area density into a solid angle density as seen from a point
+static float area_to_solid_angle(float area_pdf, Vec3 from, Vec3 point, Vec3 normal) {
+    Vec3 dir = point - from;
+    float squared_dist = dir.norm_squared();
+    float cos_theta = std::abs(dot(normal, dir)) / std::sqrt(squared_dist);
+    if(cos_theta <= 0.0f) return 0.0f;
+    return area_pdf * squared_dist / cos_theta;
+}
+
+float Directional_Light::pdf(Vec3, Vec3, Vec3) const {
+    return 0.0f;
+}
+
+float Point_Light::pdf(Vec3, Vec3, Vec3) const {
+    return 0.0f;
+}
+
+float Spot_Light::pdf(Vec3, Vec3, Vec3) const {
+    return 0.0f;
+}
+
+float Rect_Light::pdf(Vec3 from, Vec3 point, Vec3 normal) const {
+    // Only the front face is ever sampled
+    if(from.y >= 0.0f) return 0.0f;
+    return area_to_solid_angle(1.0f / (size.x * size.y), from, point, normal);
+}
+
+float Mesh_Light::pdf(Vec3 from, Vec3 point, Vec3 normal) const {
+    if(area <= 0.0f) return 0.0f;
+    return area_to_solid_angle(1.0f / area, from, point, normal);
+}
+
+float Sphere_Light::pdf(Vec3 from, Vec3 point, Vec3 normal) const {
+    return area_to_solid_angle(1.0f / (4.0f * PI_F * radius * radius), from, point, normal);
+}
+
+Spectrum Directional_Light::power() const {
+    return radiance;
+}
+
+BBox Directional_Light::bbox() const {
+    return {};
+}
+
+Spectrum Point_Light::power() const {
+    return 4.0f * PI_F * radiance;
+}
+
+BBox Point_Light::bbox() const {
+    return BBox(Vec3(0.0f), Vec3(0.0f));
+}
+
+Spectrum Spot_Light::power() const {
+    float cos_outer = std::cos(Radians(angle_bounds.y / 2.0f));
+    return 2.0f * PI_F * (1.0f - cos_outer) * radiance;
+}
+
+BBox Spot_Light::bbox() const {
+    return BBox(Vec3(0.0f), Vec3(0.0f));
+}
+
+Spectrum Rect_Light::power() const {
+    return PI_F * size.x * size.y * radiance;
+}
+
+BBox Rect_Light::bbox() const {
+    return BBox(Vec3(-size.x / 2.0f, 0.0f, -size.y / 2.0f),
+                Vec3(size.x / 2.0f, 0.0f, size.y / 2.0f));
+}
+
+Mesh_Light::Mesh_Light(Spectrum r, const GL::Mesh& mesh, const Mat4& T) : radiance(r) {
+
+    const auto& mverts = mesh.verts();
+    const auto& idxs = mesh.indices();
+
+    std::vector<float> areas;
+    for(size_t i = 0; i + 2 < idxs.size(); i += 3) {
+        Vec3 a = T * mverts[idxs[i]].pos;
+        Vec3 b = T * mverts[idxs[i + 1]].pos;
+        Vec3 c = T * mverts[idxs[i + 2]].pos;
+        float tri_area = 0.5f * cross(b - a, c - a).norm();
+        if(tri_area <= 0.0f) continue;
+
+        verts.push_back(a);
+        verts.push_back(b);
+        verts.push_back(c);
+        areas.push_back(tri_area);
+        box.enclose(a);
+        box.enclose(b);
+        box.enclose(c);
+        area += tri_area;
+    }
+    triangles.build(areas);
+}
+
+Light_Sample Mesh_Light::sample(Vec3 from) const {
+    Light_Sample ret;
+
+    // Pick a triangle by area, then a uniform point on it
+    float pmf;
+    size_t tri = triangles.sample(pmf);
+    Vec3 a = verts[3 * tri], b = verts[3 * tri + 1], c = verts[3 * tri + 2];
+
+    float su = std::sqrt(RNG::unit());
+    float u = 1.0f - su, v = RNG::unit() * su;
+    Vec3 point = u * a + v * b + (1.0f - u - v) * c;
+    Vec3 normal = cross(b - a, c - a).unit();
+
+    Vec3 dir = point - from;
+    float squared_dist = dir.norm_squared();
+    float dist = std::sqrt(squared_dist);
+    ret.direction = dir / dist;
+    ret.distance = dist;
+
+    // Emits from both sides, like BSDF_Diffuse
+    float cos_theta = std::abs(dot(normal, ret.direction));
+    if(cos_theta <= 0.0f) {
+        ret.pdf = 1.0f;
+        return ret;
+    }
+    ret.pdf = squared_dist / (area * cos_theta);
+    ret.radiance = radiance;
+    return ret;
+}
+
+Spectrum Mesh_Light::power() const {
+    return 2.0f * PI_F * area * radiance;
+}
+
+BBox Mesh_Light::bbox() const {
+    return box;
+}
+
+Light_Sample Sphere_Light::sample(Vec3 from) const {
+    Light_Sample ret;
+
+    float z = 1.0f - 2.0f * RNG::unit();
+    float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+    float phi = 2.0f * PI_F * RNG::unit();
+    Vec3 normal(r * std::cos(phi), z, r * std::sin(phi));
+    Vec3 point = radius * normal;
+
+    Vec3 dir = point - from;
+    float squared_dist = dir.norm_squared();
+    float dist = std::sqrt(squared_dist);
+    ret.direction = dir / dist;
+    ret.distance = dist;
+
+    float cos_theta = std::abs(dot(normal, ret.direction));
+    if(cos_theta <= 0.0f) {
+        ret.pdf = 1.0f;
+        return ret;
+    }
+    ret.pdf = squared_dist / (4.0f * PI_F * radius * radius * cos_theta);
+    ret.radiance = radiance;
+    return ret;
+}
+
+Spectrum Sphere_Light::power() const {
+    return 4.0f * PI_F * PI_F * radius * radius * radiance;
+}
+
+BBox Sphere_Light::bbox() const {
+    return BBox(Vec3(-radius), Vec3(radius));
+}
+
 } // namespace PT
@@ -6,6 +6,7 @@
 #include "../lib/mathlib.h"
 #include "../lib/spectrum.h"
 #include "../scene/object.h"
+#include "../util/alias_table.h"
 #include "../util/hdr_image.h"
 
 #include "samplers.h"
@@ -30,6 +31,9 @@ struct Directional_Light {
     }
 
     Light_Sample sample(Vec3 from) const;
+    Spectrum power() const;
+    BBox bbox() const;
+    float pdf(Vec3 from, Vec3 point, Vec3 normal) const;
 
     Spectrum radiance;
     Samplers::Direction sampler;
@@ -41,6 +45,9 @@ struct Point_Light {
     }
 
     Light_Sample sample(Vec3 from) const;
+    Spectrum power() const;
+    BBox bbox() const;
+    float pdf(Vec3 from, Vec3 point, Vec3 normal) const;
 
     Spectrum radiance;
     Samplers::Point sampler;
@@ -52,6 +59,9 @@ struct Spot_Light {
     }
 
     Light_Sample sample(Vec3 from) const;
+    Spectrum power() const;
+    BBox bbox() const;
+    float pdf(Vec3 from, Vec3 point, Vec3 normal) const;
 
     Spectrum radiance;
     Vec2 angle_bounds;
@@ -64,12 +74,47 @@ struct Rect_Light {
     }
 
     Light_Sample sample(Vec3 from) const;
+    Spectrum power() const;
+    BBox bbox() const;
+    float pdf(Vec3 from, Vec3 point, Vec3 normal) const;
 
     Spectrum radiance;
     Vec2 size;
     Samplers::Rect::Uniform sampler;
 };
 
+// Emissive triangle mesh; vertices are stored in world space
+struct Mesh_Light {
+
+    Mesh_Light(Spectrum r, const GL::Mesh& mesh, const Mat4& T = Mat4::I);
+
+    Light_Sample sample(Vec3 from) const;
+    Spectrum power() const;
+    BBox bbox() const;
+    float pdf(Vec3 from, Vec3 point, Vec3 normal) const;
+
+    Spectrum radiance;
+    std::vector<Vec3> verts;
+    Alias_Table triangles;
+    float area = 0.0f;
+    BBox box;
+};
+
+// Emissive sphere shape
+struct Sphere_Light {
+
+    Sphere_Light(Spectrum r, float radius) : radius(radius), radiance(r) {
+    }
+
+    Light_Sample sample(Vec3 from) const;
+    Spectrum power() const;
+    BBox bbox() const;
+    float pdf(Vec3 from, Vec3 point, Vec3 normal) const;
+
+    float radius;
+    Spectrum radiance;
+};
+
 class Light {
 public:
     Light(Directional_Light&& l, Scene_ID id, const Mat4& T = Mat4::I)
@@ -88,6 +133,14 @@ public:
         : trans(T), itrans(T.inverse()), _id(id), underlying(std::move(l)) {
         has_trans = trans != Mat4::I;
     }
+    Light(Mesh_Light&& l, Scene_ID id)
+        : trans(Mat4::I), itrans(Mat4::I), _id(id), underlying(std::move(l)) {
+        has_trans = false;
+    }
+    Light(Sphere_Light&& l, Scene_ID id, const Mat4& T = Mat4::I)
+        : trans(T), itrans(T.inverse()), _id(id), underlying(std::move(l)) {
+        has_trans = trans != Mat4::I;
+    }
 
     Light(const Light& src) = delete;
     Light& operator=(const Light& src) = delete;
@@ -102,11 +155,41 @@ public:
         return ret;
     }
 
+    // Solid angle density with which sample(from) picks the surface point
+    // (point, normal); zero for discrete lights
+    float pdf(Vec3 from, Vec3 point, Vec3 normal) const {
+        if(has_trans) {
+            from = itrans * from;
+            point = itrans * point;
+            normal = trans.T().rotate(normal).unit();
+        }
+        return std::visit(
+            overloaded{[&](const auto& l) { return l.pdf(from, point, normal); }}, underlying);
+    }
+
+    // Total emitted power, used to estimate the importance of a light
+    Spectrum power() const {
+        return std::visit(overloaded{[](const auto& l) { return l.power(); }}, underlying);
+    }
+
+    // World-space bounds of the emitter; empty for lights at infinity
+    BBox bbox() const {
+        BBox box = std::visit(overloaded{[](const auto& l) { return l.bbox(); }}, underlying);
+        if(has_trans && !box.empty()) box.transform(trans);
+        return box;
+    }
+
+    bool is_infinite() const {
+        return std::holds_alternative<Directional_Light>(underlying);
+    }
+
     bool is_discrete() const {
         return std::visit(overloaded{[](const Directional_Light&) { return true; },
                                      [](const Point_Light&) { return true; },
                                      [](const Spot_Light&) { return true; },
-                                     [](const Rect_Light&) { return false; }},
+                                     [](const Rect_Light&) { return false; },
+                                     [](const Mesh_Light&) { return false; },
+                                     [](const Sphere_Light&) { return false; }},
                           underlying);
     }
 
@@ -123,7 +206,8 @@ private:
     bool has_trans;
     Mat4 trans, itrans;
     Scene_ID _id;
-    std::variant<Directional_Light, Point_Light, Spot_Light, Rect_Light> underlying;
+    std::variant<Directional_Light, Point_Light, Spot_Light, Rect_Light, Mesh_Light, Sphere_Light>
+        underlying;
 };
 
 } // namespace PT
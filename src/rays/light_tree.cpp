@@ -0,0 +1,130 @@
+
+#include "light_tree.h"
+#include "../util/rand.h"
+
+namespace PT {
+
+void Light_Tree::clear() {
+    nodes.clear();
+    leaf_of.clear();
+    infinite_lights.clear();
+}
+
+void Light_Tree::build(const std::vector<Light>& lights) {
+
+    clear();
+    leaf_of.resize(lights.size(), SIZE_MAX);
+
+    std::vector<Entry> entries;
+    for(size_t i = 0; i < lights.size(); i++) {
+        const Light& light = lights[i];
+        if(light.is_infinite()) {
+            infinite_lights.push_back(i);
+            continue;
+        }
+        float power = light.power().luma();
+        if(power <= 0.0f) continue;
+        entries.push_back({light.bbox(), power, i});
+    }
+
+    if(entries.empty()) return;
+    nodes.reserve(2 * entries.size());
+    build_node(entries, 0, entries.size(), SIZE_MAX);
+}
+
+size_t Light_Tree::build_node(std::vector<Entry>& entries, size_t start, size_t end,
+                              size_t parent) {
+
+    size_t idx = nodes.size();
+    nodes.emplace_back();
+    nodes[idx].parent = parent;
+
+    BBox box, centroids;
+    float power = 0.0f;
+    for(size_t i = start; i < end; i++) {
+        box.enclose(entries[i].bbox);
+        centroids.enclose(entries[i].bbox.center());
+        power += entries[i].power;
+    }
+    nodes[idx].bbox = box;
+    nodes[idx].power = power;
+
+    if(end - start == 1) {
+        nodes[idx].light = entries[start].light;
+        leaf_of[entries[start].light] = idx;
+        return idx;
+    }
+
+    // Split at the median centroid along the widest axis
+    Vec3 extent = centroids.max - centroids.min;
+    int axis = 0;
+    if(extent.y > extent[axis]) axis = 1;
+    if(extent.z > extent[axis]) axis = 2;
+
+    size_t mid = (start + end) / 2;
+    std::nth_element(entries.begin() + start, entries.begin() + mid, entries.begin() + end,
+                     [axis](const Entry& a, const Entry& b) {
+                         return a.bbox.center()[axis] < b.bbox.center()[axis];
+                     });
+
+    size_t l = build_node(entries, start, mid, idx);
+    size_t r = build_node(entries, mid, end, idx);
+    nodes[idx].l = l;
+    nodes[idx].r = r;
+    return idx;
+}
+
+float Light_Tree::importance(const Node& node, Vec3 from) const {
+
+    // Power over squared distance to the cluster, clamped so that points
+    // inside the bounds don't blow up
+    Vec3 extent = node.bbox.max - node.bbox.min;
+    float dist2 = (node.bbox.center() - from).norm_squared();
+    float radius2 = 0.25f * extent.norm_squared();
+    return node.power / std::max(dist2, std::max(radius2, EPS_F));
+}
+
+float Light_Tree::p_left(const Node& node, Vec3 from) const {
+    float il = importance(nodes[node.l], from);
+    float ir = importance(nodes[node.r], from);
+    if(il + ir <= 0.0f) return 0.5f;
+    return il / (il + ir);
+}
+
+size_t Light_Tree::sample(Vec3 from, float& pmf) const {
+
+    pmf = 0.0f;
+    if(nodes.empty()) return SIZE_MAX;
+
+    pmf = 1.0f;
+    size_t idx = 0;
+    while(!nodes[idx].is_leaf()) {
+        const Node& node = nodes[idx];
+        float p = p_left(node, from);
+        if(RNG::unit() < p) {
+            pmf *= p;
+            idx = node.l;
+        } else {
+            pmf *= 1.0f - p;
+            idx = node.r;
+        }
+    }
+    return nodes[idx].light;
+}
+
+float Light_Tree::pmf(Vec3 from, size_t light) const {
+
+    if(light >= leaf_of.size() || leaf_of[light] == SIZE_MAX) return 0.0f;
+
+    float pmf = 1.0f;
+    size_t idx = leaf_of[light];
+    while(nodes[idx].parent != SIZE_MAX) {
+        const Node& parent = nodes[nodes[idx].parent];
+        float p = p_left(parent, from);
+        pmf *= parent.l == idx ? p : 1.0f - p;
+        idx = nodes[idx].parent;
+    }
+    return pmf;
+}
+
+} // namespace PT
@@ -0,0 +1,64 @@
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "light.h"
+
+namespace PT {
+
+// BVH over the scene's finite lights. Each node stores the total power of
+// the lights below it, so a light can be chosen with probability proportional
+// to its estimated contribution at a shading point in O(log n).
+class Light_Tree {
+public:
+    Light_Tree() = default;
+
+    void build(const std::vector<Light>& lights);
+    void clear();
+
+    // Pick a finite light for a shading point. Returns the index of the light
+    // in the vector the tree was built from, and sets pmf to the probability
+    // of having chosen it. Returns SIZE_MAX if there are no finite lights.
+    size_t sample(Vec3 from, float& pmf) const;
+
+    // Probability that sample(from) returns the given light
+    float pmf(Vec3 from, size_t light) const;
+
+    // Lights at infinity (e.g. directional lights) are not in the tree
+    const std::vector<size_t>& infinite() const {
+        return infinite_lights;
+    }
+    bool empty() const {
+        return nodes.empty();
+    }
+
+private:
+    struct Node {
+        BBox bbox;
+        float power = 0.0f;
+        size_t l = 0, r = 0, parent = SIZE_MAX, light = SIZE_MAX;
+
+        bool is_leaf() const {
+            return light != SIZE_MAX;
+        }
+    };
+
+    struct Entry {
+        BBox bbox;
+        float power;
+        size_t light;
+    };
+
+    size_t build_node(std::vector<Entry>& entries, size_t start, size_t end, size_t parent);
+    float importance(const Node& node, Vec3 from) const;
+    float p_left(const Node& node, Vec3 from) const;
+
+    std::vector<Node> nodes;
+    std::vector<size_t> leaf_of;
+    std::vector<size_t> infinite_lights;
+};
+
+} // namespace PT
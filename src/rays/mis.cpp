@@ -0,0 +1,193 @@
+
+#include "../util/rand.h"
+#include "pathtracer.h"
+
+namespace PT {
+
+// Footprint of rays leaving a non-discrete BSDF, in radians. Environment
+// lookups from such a vertex blur over it, whether the direction came from
+// light or BSDF sampling, so the two strategies estimate the same integrand.
+// It is kept far below the width of a diffuse lobe, so the blur doesn't
+// show in the shading.
+static const float bounce_spread = 0.05f;
+
+static Light_Sample sample_from(const Light& light, Vec3 from, float) {
+    return light.sample(from);
+}
+
+static Light_Sample sample_from(const Env_Light& env, Vec3 from, float spread) {
+    return env.sample(from, spread);
+}
+
+static float power_heuristic(float f_pdf, float g_pdf) {
+    float f2 = f_pdf * f_pdf, g2 = g_pdf * g_pdf;
+    if(f2 + g2 <= 0.0f) return 0.0f;
+    return f2 / (f2 + g2);
+}
+
+float Pathtracer::light_rate(size_t light, Vec3 from) const {
+
+    // Expected number of samples per hit that light sampling draws from this
+    // light (or from the environment, if light == lights.size())
+    bool env = light == lights.size();
+    switch(light_sampling) {
+    case Light_Sampling::power: return n_light_samples * light_power.pmf(light);
+    case Light_Sampling::tree: {
+        if(env || lights[light].is_infinite()) return (float)n_area_samples;
+        return n_light_samples * light_tree.pmf(from, light);
+    }
+    default: return (float)n_area_samples;
+    }
+}
+
+Spectrum Pathtracer::trace_pixel_mis(size_t x, size_t y) {
+
+    Vec2 xy((float)x + RNG::unit(), (float)y + RNG::unit());
+    Vec2 wh((float)out_w, (float)out_h);
+    return trace_ray_mis(camera.generate_ray(xy / wh));
+}
+
+Spectrum Pathtracer::trace_ray_mis(const Ray& camera_ray) {
+
+    Spectrum radiance, throughput(1.0f);
+    Ray ray = camera_ray;
+
+    // Density of the BSDF sample that generated the current ray. Camera rays
+    // and discrete BSDF samples can't be generated by light sampling.
+    float bsdf_pdf = 0.0f;
+    bool from_discrete = true;
+
+    for(size_t depth = 0;; depth++) {
+
+        Trace hit = scene.hit(ray);
+        if(!hit.hit) {
+            if(env_light.has_value()) {
+                const Env_Light& env = env_light.value();
+                float w = 1.0f;
+                if(!from_discrete) {
+                    float light_pdf = light_rate(lights.size(), ray.point) * env.pdf(ray.dir);
+                    w = power_heuristic(bsdf_pdf, light_pdf);
+                }
+                radiance += throughput * env.sample_direction(ray.dir, ray.spread) * w;
+            }
+            break;
+        }
+
+        const BSDF& bsdf = materials[hit.material];
+        if(!bsdf.is_sided() && dot(hit.normal, ray.dir) > 0.0f) {
+            hit.normal = -hit.normal;
+        }
+
+        Mat4 object_to_world = Mat4::rotate_to(hit.normal);
+        Mat4 world_to_object = object_to_world.T();
+        Vec3 out_dir = world_to_object.rotate(ray.point - hit.position).unit();
+
+        // Discrete BSDFs keep the footprint of the ray that arrived
+        float spread = ray.spread;
+        if(!bsdf.is_discrete()) spread = std::max(spread, bounce_spread);
+
+        // Emission found by BSDF sampling, weighted against the chance that
+        // light sampling would have found the same point
+        Spectrum emitted = bsdf.emissive();
+        if(emitted.luma() > 0.0f) {
+            float w = 1.0f;
+            auto entry = emitter_lights.find(hit.material);
+            if(!from_discrete && entry != emitter_lights.end()) {
+                const Light& light = lights[entry->second];
+                float light_pdf = light_rate(entry->second, ray.point) *
+                                  light.pdf(ray.point, hit.position, hit.normal);
+                w = power_heuristic(bsdf_pdf, light_pdf);
+            }
+            radiance += throughput * emitted * w;
+        }
+
+        if(depth + 1 >= max_depth) break;
+
+        // Light sampling
+        if(!bsdf.is_discrete()) {
+
+            auto sample_light = [&](const auto& light, float rate) {
+                if(rate <= 0.0f) return;
+
+                Light_Sample sample = sample_from(light, hit.position, spread);
+                if(sample.pdf <= 0.0f || sample.radiance.luma() == 0.0f) return;
+
+                Vec3 in_dir = world_to_object.rotate(sample.direction);
+                float cos_theta = in_dir.y;
+                if(cos_theta <= 0.0f) return;
+
+                Spectrum attenuation = bsdf.evaluate(out_dir, in_dir);
+                if(attenuation.luma() == 0.0f) return;
+
+                Ray shadow(hit.position, sample.direction);
+                shadow.dist_bounds = Vec2(EPS_F, sample.distance - EPS_F);
+                if(scene.hit(shadow).hit) return;
+
+                float w = 1.0f;
+                if(!light.is_discrete()) {
+                    w = power_heuristic(rate * sample.pdf, bsdf.pdf(out_dir, in_dir));
+                }
+                radiance += throughput * sample.radiance * attenuation *
+                            (w * cos_theta / (rate * sample.pdf));
+            };
+
+            auto sample_all = [&](const auto& light) {
+                int samples = light.is_discrete() ? 1 : (int)n_area_samples;
+                for(int i = 0; i < samples; i++) sample_light(light, (float)samples);
+            };
+
+            if(light_sampling == Light_Sampling::power) {
+                for(size_t i = 0; i < n_light_samples && !light_power.empty(); i++) {
+                    float pmf;
+                    size_t idx = light_power.sample(pmf);
+                    if(idx < lights.size()) {
+                        sample_light(lights[idx], n_light_samples * pmf);
+                    } else {
+                        sample_light(env_light.value(), n_light_samples * pmf);
+                    }
+                }
+            } else if(light_sampling == Light_Sampling::tree) {
+                for(size_t i = 0; i < n_light_samples; i++) {
+                    float pmf;
+                    size_t idx = light_tree.sample(hit.position, pmf);
+                    if(idx == SIZE_MAX) break;
+                    sample_light(lights[idx], n_light_samples * pmf);
+                }
+                for(size_t idx : light_tree.infinite()) sample_all(lights[idx]);
+                if(env_light.has_value()) sample_all(env_light.value());
+            } else {
+                for(const Light& light : lights) sample_all(light);
+                if(env_light.has_value()) sample_all(env_light.value());
+            }
+        }
+
+        // BSDF sampling
+        BSDF_Sample sample = bsdf.sample(out_dir);
+        if(sample.pdf <= 0.0f) break;
+
+        float cos_theta = std::abs(sample.direction.y);
+        throughput *= sample.attenuation * (cos_theta / sample.pdf);
+        if(throughput.luma() <= 0.0f || !throughput.valid()) break;
+
+        // Russian roulette once the path has had a few bounces
+        if(depth >= 3) {
+            float survive = std::min(throughput.luma(), 0.95f);
+            if(!RNG::coin_flip(survive)) break;
+            throughput *= 1.0f / survive;
+        }
+
+        from_discrete = bsdf.is_discrete();
+        bsdf_pdf = sample.pdf;
+
+        Vec3 in_dir = object_to_world.rotate(sample.direction);
+        ray = Ray(hit.position, in_dir);
+        ray.dist_bounds.x = EPS_F;
+        ray.depth = depth + 1;
+        ray.throughput = throughput;
+        ray.spread = spread;
+    }
+
+    return radiance;
+}
+
+} // namespace PT
@@ -49,6 +49,7 @@ public:
             std::visit(overloaded{[&ray](const auto& o) { return o.hit(ray); }}, underlying);
         if(ret.hit) {
             ret.material = material;
+            ret.id = _id;
             if(has_trans) ret.transform(trans, itrans.T());
         }
         return ret;
@@ -72,6 +73,9 @@ public:
         itrans = T.inverse();
         has_trans = trans != Mat4::I;
     }
+    void set_material(unsigned int m) {
+        material = m;
+    }
 
 private:
     bool has_trans;
@@ -2,14 +2,28 @@
 #include "pathtracer.h"
 #include "../geometry/util.h"
 #include "../gui/render.h"
+#include "../util/exr.h"
+#include "../util/rand.h"
+#include "denoise.h"
 
 #include <SDL2/SDL.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
 #include <thread>
 
 namespace PT {
 
+const char* Light_Sampling_Names[(int)Light_Sampling::count] = {"All Lights", "By Power",
+                                                                 "Light BVH"};
+
+const char* Integrator_Names[(int)Integrator::count] = {"Path", "MIS"};
+
+const char* Shard_Mode_Names[(int)Shard_Mode::count] = {"Rows", "Samples"};
+
 Pathtracer::Pathtracer(Gui::Widget_Render& gui, Vec2 screen_dim)
-    : thread_pool(std::thread::hardware_concurrency()), gui(gui), camera(screen_dim) {
+    : tasks(Thread_Pool::get(), Task_Priority::background), gui(gui), camera(screen_dim) {
     accumulator_samples = 0;
     total_epochs = 0;
     completed_epochs = 0;
@@ -20,12 +34,15 @@ Pathtracer::Pathtracer(Gui::Widget_Render& gui, Vec2 screen_dim)
 
 Pathtracer::~Pathtracer() {
     cancel();
-    thread_pool.stop();
 }
 
 void Pathtracer::build_lights(Scene& layout_scene, std::vector<Object>& objs) {
 
     lights.clear();
+
+    // Building an Env_Map sampler is expensive for large images, so keep the
+    // previous one around if the scene still uses the same image
+    std::optional<Env_Light> prev_env = std::move(env_light);
     env_light.reset();
 
     layout_scene.for_items([&, this](const Scene_Item& item) {
@@ -40,7 +57,12 @@ void Pathtracer::build_lights(Scene& layout_scene, std::vector<Object>& objs) {
             } break;
             case Light_Type::sphere: {
                 if(light.opt.has_emissive_map) {
-                    env_light = Env_Light(Env_Map(light.emissive_copy()));
+                    if(prev_env.has_value() && prev_env.value().map_id() == light.emissive_id() &&
+                       prev_env.value().map_format() == env_format) {
+                        env_light = std::move(prev_env);
+                    } else {
+                        env_light = Env_Light(Env_Map(light.emissive_copy(), env_format));
+                    }
                 } else {
                     env_light = Env_Light(Env_Sphere(r));
                 }
@@ -79,6 +101,95 @@ void Pathtracer::build_lights(Scene& layout_scene, std::vector<Object>& objs) {
     });
 }
 
+void Pathtracer::build_light_tables() {
+
+    if(integrator == Integrator::mis) {
+        for(Light& light : emissive_lights) lights.push_back(std::move(light));
+        emissive_lights.clear();
+    } else if(lights.size() > n_scene_lights) {
+        std::move(lights.begin() + n_scene_lights, lights.end(),
+                  std::back_inserter(emissive_lights));
+        lights.erase(lights.begin() + n_scene_lights, lights.end());
+    }
+    tables_integrator = integrator;
+
+    light_tree.build(lights);
+
+    // Lets the MIS integrator find the light behind an emissive surface
+    emitter_lights.clear();
+    for(size_t i = 0; i < lights.size(); i++) {
+        auto entry = mat_cache.find(lights[i].id());
+        if(entry != mat_cache.end() && !lights[i].is_discrete()) {
+            emitter_lights[(unsigned int)entry->second] = i;
+        }
+    }
+
+    // Lights at infinity deliver power to the scene through its bounding
+    // disc, so they are weighted by its area
+    BBox box = scene.bbox();
+    float disc = box.empty() ? 1.0f : PI_F * 0.25f * (box.max - box.min).norm_squared();
+
+    std::vector<float> weights;
+    for(const Light& light : lights) {
+        float power = light.power().luma();
+        weights.push_back(light.is_infinite() ? power * disc : power);
+    }
+    if(env_light.has_value()) {
+        weights.push_back(env_light.value().power().luma() * disc);
+    }
+    light_power.build(weights);
+}
+
+const std::vector<Light_Choice>& Pathtracer::select_lights(Vec3 from) const {
+
+    // Reused so that picking lights at each hit doesn't allocate
+    static thread_local std::vector<Light_Choice> choices;
+    choices.clear();
+
+    auto add = [](const Light* light, const Env_Light* env, float rate) {
+        Light_Choice choice;
+        choice.light = light;
+        choice.env = env;
+        choice.rate = rate;
+        choices.push_back(choice);
+    };
+    const Env_Light* env = env_light.has_value() ? &env_light.value() : nullptr;
+
+    switch(light_sampling) {
+    case Light_Sampling::tree: {
+        // A fixed number of lights drawn according to their estimated
+        // importance, so the cost doesn't grow with the light count
+        for(size_t i = 0; i < n_light_samples; i++) {
+            float pmf;
+            size_t idx = light_tree.sample(from, pmf);
+            if(idx == SIZE_MAX || pmf == 0.0f) break;
+            add(&lights[idx], nullptr, n_light_samples * pmf);
+        }
+        for(size_t idx : light_tree.infinite()) add(&lights[idx], nullptr, 1.0f);
+        if(env) add(nullptr, env, 1.0f);
+    } break;
+    case Light_Sampling::power: {
+        // Lights, including the environment, in proportion to their power
+        for(size_t i = 0; i < n_light_samples && !light_power.empty(); i++) {
+            float pmf;
+            size_t idx = light_power.sample(pmf);
+            if(pmf == 0.0f) continue;
+            float rate = n_light_samples * pmf;
+            if(idx < lights.size()) {
+                add(&lights[idx], nullptr, rate);
+            } else {
+                add(nullptr, env, rate);
+            }
+        }
+    } break;
+    default: {
+        for(const Light& light : lights) add(&light, nullptr, 1.0f);
+        if(env) add(nullptr, env, 1.0f);
+    } break;
+    }
+    return choices;
+}
+
 void Pathtracer::build_scene(Scene& layout_scene) {
 
     // It would be nice to let the interface be usable here (as with
@@ -96,9 +207,19 @@ void Pathtracer::build_scene(Scene& layout_scene) {
     // default constructor for Object so whatever
     std::mutex obj_mut;
     std::vector<Object> obj_list;
+    std::vector<Light> emitters;
     materials.clear();
     mat_cache.clear();
 
+    // Meshes whose geometry hasn't changed since the last build keep their
+    // BVH; pose and material edits are patched onto the existing object.
+    std::unordered_map<Scene_ID, Object> prev_meshes;
+    for(Object& obj : scene.destructure()) {
+        if(mesh_versions.count(obj.id())) prev_meshes.emplace(obj.id(), std::move(obj));
+    }
+    std::unordered_map<Scene_ID, uint64_t> prev_versions = std::move(mesh_versions);
+    mesh_versions.clear();
+
     layout_scene.for_items([&, this](Scene_Item& item) {
         if(item.is<Scene_Object>()) {
 
@@ -125,19 +246,55 @@ void Pathtracer::build_scene(Scene& layout_scene) {
             default: return;
             }
 
-            thread_pool.enqueue([&, idx]() {
-                if(obj.is_shape()) {
-                    Shape shape(obj.opt.shape);
-                    std::lock_guard<std::mutex> lock(obj_mut);
-                    obj_list.push_back(
-                        Object(std::move(shape), obj.id(), idx, obj.pose.transform()));
-                } else {
-                    Tri_Mesh mesh(obj.posed_mesh());
-                    std::lock_guard<std::mutex> lock(obj_mut);
+            // Emissive objects may also be sampled as lights (see emissive_lights)
+            bool emissive = opt.type == Material_Type::diffuse_light;
+            if(emissive) mat_cache[obj.id()] = idx;
+
+            if(obj.is_shape()) {
+                Shape shape(obj.opt.shape);
+                std::lock_guard<std::mutex> lock(obj_mut);
+                if(emissive) {
+                    float radius = obj.opt.shape.get<Sphere>().radius;
+                    emitters.push_back(Light(Sphere_Light(obj.material.emissive(), radius),
+                                             obj.id(), obj.pose.transform()));
+                }
+                obj_list.push_back(Object(std::move(shape), obj.id(), idx, obj.pose.transform()));
+                return;
+            }
+
+            uint64_t version = obj.geometry_id();
+            mesh_versions[obj.id()] = version;
+
+            auto prev = prev_meshes.find(obj.id());
+            auto prev_version = prev_versions.find(obj.id());
+            bool reuse = prev != prev_meshes.end() && prev_version != prev_versions.end() &&
+                         prev_version->second == version;
+            if(reuse) {
+                Object mesh = std::move(prev->second);
+                mesh.set_trans(obj.pose.transform());
+                mesh.set_material(idx);
+                std::lock_guard<std::mutex> lock(obj_mut);
+                obj_list.push_back(std::move(mesh));
+                if(!emissive) return;
+            }
+
+            // The build blocks the UI, so it goes ahead of running renders
+            tasks.run([&, idx, emissive, reuse]() {
+                std::optional<Tri_Mesh> mesh;
+                if(!reuse) mesh = Tri_Mesh(obj.posed_mesh());
+                std::optional<Light> emitter;
+                if(emissive) {
+                    Mesh_Light light(obj.material.emissive(), obj.posed_mesh(),
+                                     obj.pose.transform());
+                    if(light.area > 0.0f) emitter = Light(std::move(light), obj.id());
+                }
+                std::lock_guard<std::mutex> lock(obj_mut);
+                if(emitter.has_value()) emitters.push_back(std::move(emitter.value()));
+                if(mesh.has_value()) {
                     obj_list.push_back(
-                        Object(std::move(mesh), obj.id(), idx, obj.pose.transform()));
+                        Object(std::move(mesh.value()), obj.id(), idx, obj.pose.transform()));
                 }
-            });
+            }, Task_Priority::interactive);
 
         } else if(item.is<Scene_Particles>()) {
 
@@ -145,7 +302,7 @@ void Pathtracer::build_scene(Scene& layout_scene) {
             unsigned int idx = (unsigned int)materials.size();
             materials.push_back(BSDF(BSDF_Diffuse(particles.opt.color)));
 
-            thread_pool.enqueue([&, idx]() {
+            tasks.run([&, idx]() {
                 Tri_Mesh mesh(particles.mesh());
 
                 const auto& parts = particles.get_particles();
@@ -156,14 +313,21 @@ void Pathtracer::build_scene(Scene& layout_scene) {
                     std::lock_guard<std::mutex> lock(obj_mut);
                     obj_list.push_back(Object(std::move(copy), particles.id(), idx, T));
                 }
-            });
+            }, Task_Priority::interactive);
         }
     });
 
-    thread_pool.wait();
+    tasks.wait();
     build_lights(layout_scene, obj_list);
 
+    // Tasks finish in any order; keep light indices stable between builds
+    std::sort(emitters.begin(), emitters.end(),
+              [](const Light& l, const Light& r) { return l.id() < r.id(); });
+    n_scene_lights = lights.size();
+    emissive_lights = std::move(emitters);
+
     scene.build(std::move(obj_list));
+    build_light_tables();
 }
 
 void Pathtracer::set_sizes(size_t w, size_t h, size_t samples, size_t area_samples, size_t depth) {
@@ -172,48 +336,281 @@ void Pathtracer::set_sizes(size_t w, size_t h, size_t samples, size_t area_sampl
     n_samples = samples;
     n_area_samples = area_samples;
     max_depth = depth;
-    accumulator.resize(out_w, out_h);
+    window_begin = 0;
+    window_rows = out_h;
+    resized = true;
+}
+
+void Pathtracer::set_window(size_t row_begin, size_t row_end) {
+    assert(row_begin <= row_end && row_end <= out_h);
+    cancel();
+    window_begin = row_begin;
+    window_rows = row_end - row_begin;
+    resized = true;
+}
+
+void Pathtracer::allocate() {
+
+    // Deferred to the start of a render, so setting a window right after
+    // the size never allocates buffers for the whole image
+    if(!resized) return;
+    resized = false;
+    traced_samples = 0;
+
+    size_t n = out_w * window_rows;
+    accumulator.resize(out_w, window_rows);
+    if(show_display) {
+        display.resize(out_w, window_rows);
+    } else {
+        display.resize(0, 0);
+    }
+    reset_accumulator();
+
+    aovs.depth.assign(n, 0.0f);
+    aovs.id.assign(n, 0.0f);
+    aovs.normal.assign(n, Vec3{});
+    aovs.albedo.assign(n, Spectrum{});
+}
+
+void Pathtracer::reset_accumulator() {
+    accumulator.clear({});
+    accumulator_luma2.assign(out_w * window_rows, 0.0f);
+    accumulator_counts.assign(out_w * window_rows, 0);
+    accumulator_samples = 0;
+    publish(accumulator);
+}
+
+void Pathtracer::publish(const HDR_Image& image, size_t row_begin, size_t row_end) {
+    if(show_display) display.publish(image, row_begin, row_end);
+}
+
+void Pathtracer::publish(const HDR_Image& image) {
+    if(show_display) display.publish(image);
+}
+
+void Pathtracer::set_display(bool enable) {
+    if(enable == show_display) return;
+    cancel();
+    show_display = enable;
+    resized = true;
+}
+
+void Pathtracer::set_aovs(bool enable) {
+    collect_aovs = enable;
+}
+
+void Pathtracer::set_denoise(bool enable) {
+    denoise_output = enable;
+    if(has_denoised) {
+        std::lock_guard<std::mutex> lock(accumulator_mut);
+        publish(accumulator);
+    }
+    has_denoised = false;
+}
+
+void Pathtracer::denoise() {
+
+    if(!denoise_output || has_denoised || in_progress()) return;
+
+    // Spread of the epoch means, as in relative_error
+    std::vector<float> variance;
+    size_t k = accumulator_samples;
+    if(k >= 2) {
+        variance.resize(out_w * window_rows);
+        for(size_t i = 0; i < out_w * window_rows; i++) {
+            float mean = accumulator.at(i).luma();
+            variance[i] = std::max(accumulator_luma2[i] - mean * mean, 0.0f) / (k - 1);
+        }
+    }
+
+    PT::denoise(accumulator, denoised, {aovs.normal, aovs.depth, aovs.albedo, variance},
+                tasks.get_pool());
+    has_denoised = true;
+
+    std::lock_guard<std::mutex> lock(accumulator_mut);
+    publish(denoised);
+}
+
+void Pathtracer::copy_settings(const Pathtracer& src) {
+    set_sizes(src.out_w, src.out_h, src.n_samples, src.n_area_samples, src.max_depth);
+    set_light_sampling(src.light_sampling, src.n_light_samples);
+    set_integrator(src.integrator);
+    set_env_format(src.env_format);
+    set_shard(src.shard_mode, src.shard, src.n_shards);
+    set_aovs(src.collect_aovs);
+    set_denoise(src.denoise_output);
+    set_display(src.show_display);
+}
+
+void Pathtracer::set_light_sampling(Light_Sampling mode, size_t samples) {
+    light_sampling = mode;
+    n_light_samples = std::max(size_t(1), samples);
+}
+
+void Pathtracer::set_integrator(Integrator mode) {
+    integrator = mode;
+}
+
+void Pathtracer::set_env_format(Pixel_Format format) {
+    env_format = format;
+}
+
+void Pathtracer::set_shard(Shard_Mode mode, size_t index, size_t count) {
+    shard_mode = mode;
+    n_shards = std::max(size_t(1), count);
+    shard = std::min(index, n_shards - 1);
+}
+
+std::pair<size_t, size_t> Pathtracer::shard_range(size_t n) const {
+    return {n * shard / n_shards, n * (shard + 1) / n_shards};
 }
 
 void Pathtracer::log_ray(const Ray& ray, float t, Spectrum color) {
     gui.log_ray(ray, t, color);
 }
 
-void Pathtracer::accumulate(const HDR_Image& sample) {
+void Pathtracer::accumulate(size_t epoch, Epoch&& sample) {
 
     std::lock_guard<std::mutex> lock(accumulator_mut);
 
-    accumulator_samples++;
-    for(size_t j = 0; j < out_h; j++) {
+    pending_epochs.emplace(epoch, std::move(sample));
+
+    for(auto entry = pending_epochs.find(next_epoch); entry != pending_epochs.end();
+        entry = pending_epochs.find(next_epoch)) {
+
+        const HDR_Image& next = entry->second.image;
+        const std::vector<uint32_t>& counts = entry->second.samples;
+        accumulator_samples++;
+
+        // Each band of tiles is shown as soon as it is folded in
+        for(size_t band = 0; band < window_rows; band += Display_Buffer::tile_size) {
+            size_t band_end = std::min(band + Display_Buffer::tile_size, window_rows);
+            for(size_t j = band; j < band_end; j++) {
+                for(size_t i = 0; i < out_w; i++) {
+                    Spectrum& s = accumulator.at(i, j);
+                    const Spectrum& n = next.at(i, j);
+                    s += (n - s) * (1.0f / accumulator_samples);
+
+                    float& l2 = accumulator_luma2[j * out_w + i];
+                    l2 += (n.luma() * n.luma() - l2) * (1.0f / accumulator_samples);
+                    accumulator_counts[j * out_w + i] += counts[j * out_w + i];
+                }
+            }
+            publish(accumulator, band, band_end);
+        }
+        pending_epochs.erase(entry);
+        next_epoch++;
+    }
+}
+
+float Pathtracer::relative_error() {
+
+    // Each epoch's mean is an independent estimate of the pixel, so the
+    // spread of epoch means gives the standard error of the accumulated mean.
+    // Summing over the image weights pixels by brightness, so dark pixels
+    // with a few fireflies don't keep the error from ever converging.
+    static const size_t min_epochs = 4;
+
+    std::lock_guard<std::mutex> lock(accumulator_mut);
+
+    size_t k = accumulator_samples;
+    if(k < min_epochs) return std::numeric_limits<float>::infinity();
+
+    const HDR_Image& image = accumulator;
+    double error = 0.0, total = 0.0;
+    for(size_t i = 0; i < out_w * window_rows; i++) {
+        float mean = image.at(i).luma();
+        float var = std::max(accumulator_luma2[i] - mean * mean, 0.0f) * k / (k - 1);
+        error += std::sqrt(var / k);
+        total += mean;
+    }
+    return total > 0.0 ? (float)(error / total) : 0.0f;
+}
+
+std::pair<size_t, size_t> Pathtracer::traced_rows() const {
+    size_t row_begin = window_begin, row_end = window_begin + window_rows;
+    if(shard_mode == Shard_Mode::rows) {
+        auto [shard_begin, shard_end] = shard_range(out_h);
+        row_begin = std::max(row_begin, shard_begin);
+        row_end = std::max(row_begin, std::min(row_end, shard_end));
+    }
+    return {row_begin, row_end};
+}
+
+void Pathtracer::do_aovs() {
+
+    auto [row_begin, row_end] = traced_rows();
+
+    Vec2 wh((float)out_w, (float)out_h);
+    Vec3 front = camera.front();
+
+    for(size_t j = row_begin; j < row_end; j++) {
+
+        if(cancel_flag.load(std::memory_order_relaxed)) return;
+        tasks.get_pool().preempt(Task_Priority::background);
+
         for(size_t i = 0; i < out_w; i++) {
-            Spectrum& s = accumulator.at(i, j);
-            const Spectrum& n = sample.at(i, j);
-            s += (n - s) * (1.0f / accumulator_samples);
+
+            Ray ray = camera.generate_ray((Vec2((float)i, (float)j) + Vec2(0.5f)) / wh);
+            Trace hit = scene.hit(ray);
+
+            size_t idx = (j - window_begin) * out_w + i;
+            if(hit.hit) {
+                aovs.depth[idx] = dot(hit.position - ray.point, front);
+                aovs.normal[idx] = hit.normal;
+                aovs.albedo[idx] = materials[hit.material].albedo();
+                aovs.id[idx] = (float)hit.id;
+            } else {
+                aovs.depth[idx] = std::numeric_limits<float>::infinity();
+                aovs.normal[idx] = Vec3{};
+                aovs.albedo[idx] = Spectrum{};
+                aovs.id[idx] = 0.0f;
+            }
         }
     }
 }
 
-void Pathtracer::do_trace(size_t samples) {
+Spectrum Pathtracer::trace_sample(size_t x, size_t y) {
+    if(integrator == Integrator::mis) return trace_pixel_mis(x, y);
+    return trace_pixel(x, y);
+}
+
+void Pathtracer::do_trace(size_t epoch, size_t first_sample, size_t samples) {
+
+    auto [row_begin, row_end] = traced_rows();
+
+    Epoch sample{HDR_Image(out_w, window_rows), std::vector<uint32_t>(out_w * window_rows, 0)};
+    for(size_t j = row_begin; j < row_end; j++) {
+
+        if(cancel_flag.load(std::memory_order_relaxed)) return;
+        // Let the UI's work (scene builds, previews) run between scanlines
+        tasks.get_pool().preempt(Task_Priority::background);
 
-    HDR_Image sample(out_w, out_h);
-    for(size_t j = 0; j < out_h; j++) {
         for(size_t i = 0; i < out_w; i++) {
 
-            size_t sampled = 0;
+            Spectrum& pixel = sample.image.at(i, j - window_begin);
+            uint32_t& sampled = sample.samples[(j - window_begin) * out_w + i];
             for(size_t s = 0; s < samples; s++) {
 
-                Spectrum p = trace_pixel(i, j);
+                // Each (pixel, sample) pair gets its own random stream, so the
+                // image does not depend on thread count or scheduling
+                RNG::set_stream(j * out_w + i, (uint32_t)(first_sample + s));
+
+                Spectrum p = trace_sample(i, j);
                 if(p.valid()) {
-                    sample.at(i, j) += p;
+                    pixel += p;
                     sampled++;
                 }
-
-                if(cancel_flag) return;
             }
-            sample.at(i, j) *= (1.0f / sampled);
+            pixel *= (1.0f / sampled);
         }
     }
-    accumulate(sample);
+    accumulate(epoch, std::move(sample));
+}
+
+bool Pathtracer::wait_for(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(finished_mut);
+    return finished.wait_for(lock, timeout, [this]() { return !in_progress(); });
 }
 
 bool Pathtracer::in_progress() const {
@@ -233,55 +630,429 @@ size_t Pathtracer::visualize_bvh(GL::Lines& lines, GL::Lines& active, size_t dep
     return scene.visualize(lines, active, depth, Mat4::I);
 }
 
-void Pathtracer::begin_render(Scene& layout_scene, const Camera& cam, bool add_samples) {
+void Pathtracer::do_preview(size_t scale) {
+
+    // Preview rows covering the window
+    size_t first = window_begin / scale;
+    size_t w = (out_w + scale - 1) / scale;
+    size_t h = (window_begin + window_rows + scale - 1) / scale - first;
+
+    HDR_Image preview(w, h);
+    for(size_t j = 0; j < h; j++) {
+
+        if(cancel_flag.load(std::memory_order_relaxed)) return;
+
+        for(size_t i = 0; i < w; i++) {
+            size_t x = std::min(i * scale + scale / 2, out_w - 1);
+            size_t y = std::min((first + j) * scale + scale / 2, out_h - 1);
+
+            // Sample indices count down from the top so previews never share
+            // a stream with the full resolution epochs
+            RNG::set_stream(y * out_w + x, UINT32_MAX - (uint32_t)scale);
+
+            Spectrum p = trace_sample(x, y);
+            if(p.valid()) preview.at(i, j) = p;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(accumulator_mut);
+
+    // Full resolution samples and finer previews take precedence
+    if(accumulator_samples > 0 || (preview_scale && preview_scale <= scale)) return;
+    preview_scale = scale;
+
+    for(size_t j = 0; j < window_rows; j++) {
+        for(size_t i = 0; i < out_w; i++) {
+            accumulator.at(i, j) = preview.at(i / scale, (window_begin + j) / scale - first);
+        }
+    }
+    publish(accumulator);
+}
 
-    size_t n_threads = std::thread::hardware_concurrency();
-    size_t samples_per_epoch = std::max(size_t(1), n_samples / (n_threads * 10));
+void Pathtracer::begin_render(Scene& layout_scene, const Camera& cam, bool add_samples) {
 
     cancel();
-    total_epochs = n_samples / samples_per_epoch + !!(n_samples % samples_per_epoch);
+    allocate();
 
     if(!add_samples) {
-        accumulator.clear({});
-        accumulator_samples = 0;
+        reset_accumulator();
+        traced_samples = 0;
         build_time = SDL_GetPerformanceCounter();
         build_scene(layout_scene);
         build_time = SDL_GetPerformanceCounter() - build_time;
+    } else if(tables_integrator != integrator) {
+        build_light_tables();
     }
-    render_time = SDL_GetPerformanceCounter();
-    
+
     camera = cam;
+    enqueue_epochs();
+}
+
+void Pathtracer::begin_progressive(Scene& layout_scene, const Camera& cam, bool rebuild) {
+
+    static const size_t preview_scales[] = {16, 4};
+
+    cancel();
+    allocate();
 
-    for(size_t s = 0; s < n_samples; s += samples_per_epoch) {
-        size_t samples = (s + samples_per_epoch) > n_samples ? n_samples - s : samples_per_epoch;
-        thread_pool.enqueue([samples, this]() {
-            do_trace(samples);
+    reset_accumulator();
+    traced_samples = 0;
+    preview_scale = 0;
+
+    if(rebuild) {
+        build_time = SDL_GetPerformanceCounter();
+        build_scene(layout_scene);
+        build_time = SDL_GetPerformanceCounter() - build_time;
+    } else if(tables_integrator != integrator) {
+        build_light_tables();
+    }
+
+    camera = cam;
+    for(size_t scale : preview_scales) {
+        if(scale < out_w || scale < out_h) {
+            tasks.run([scale, this]() { do_preview(scale); }, Task_Priority::interactive);
+        }
+    }
+    enqueue_epochs();
+}
+
+void Pathtracer::enqueue_epochs(size_t first_epoch) {
+
+    // The epoch split must not depend on the thread count, otherwise the
+    // accumulated image would differ between machines
+    static const size_t max_epochs = 256;
+
+    size_t sample_begin = 0, sample_end = n_samples;
+    if(shard_mode == Shard_Mode::samples) {
+        std::tie(sample_begin, sample_end) = shard_range(n_samples);
+    }
+    size_t n = sample_end - sample_begin;
+    size_t samples_per_epoch = std::max(size_t(1), n / max_epochs);
+
+    total_epochs = n / samples_per_epoch + !!(n % samples_per_epoch);
+    completed_epochs = first_epoch;
+    next_epoch = first_epoch;
+    if(has_denoised) {
+        std::lock_guard<std::mutex> lock(accumulator_mut);
+        publish(accumulator);
+    }
+    has_denoised = false;
+    render_time = SDL_GetPerformanceCounter();
+
+    size_t epoch = 0;
+    for(size_t s = 0; s < n; s += samples_per_epoch, epoch++) {
+        if(epoch < first_epoch) continue;
+        size_t samples = (s + samples_per_epoch) > n ? n - s : samples_per_epoch;
+        size_t first = traced_samples + sample_begin + s;
+        // The first epoch also fills in the AOVs
+        bool aovs = (collect_aovs || denoise_output) && epoch == first_epoch;
+        tasks.run([epoch, first, samples, aovs, this]() {
+            if(aovs) do_aovs();
+            do_trace(epoch, first, samples);
             size_t completed = completed_epochs.fetch_add(1);
             if(completed + 1 == total_epochs) {
                 Uint64 done = SDL_GetPerformanceCounter();
                 render_time = done - render_time;
+                std::lock_guard<std::mutex> lock(finished_mut);
+                finished.notify_all();
             }
         });
     }
+    traced_samples += n_samples;
+}
+
+// Written to checkpoints as is, so every byte must be a field: twelve 32 bit
+// fields keep the 64 bit ones aligned without padding
+struct Pathtracer::Checkpoint_Header {
+    char magic[8] = {'C', '3', 'D', 'C', 'K', 'P', 'T', '2'};
+    uint32_t w = 0, h = 0;
+    uint32_t samples = 0, area_samples = 0, depth = 0;
+    uint32_t light_sampling = 0, light_samples = 0, integrator = 0;
+    uint32_t shard_mode = 0, shard = 0, shards = 1;
+    uint32_t env_format = 0;
+    uint64_t seed = 0, epochs = 0;
+
+    bool operator==(const Checkpoint_Header& r) const {
+        return std::memcmp(magic, r.magic, sizeof(magic)) == 0 && w == r.w && h == r.h &&
+               samples == r.samples && area_samples == r.area_samples && depth == r.depth &&
+               light_sampling == r.light_sampling && light_samples == r.light_samples &&
+               integrator == r.integrator && shard_mode == r.shard_mode && shard == r.shard &&
+               shards == r.shards && env_format == r.env_format && seed == r.seed;
+    }
+};
+
+Pathtracer::Checkpoint_Header Pathtracer::checkpoint_header() const {
+    static_assert(sizeof(Checkpoint_Header) == 8 + 12 * 4 + 2 * 8,
+                  "Checkpoint_Header must not have padding");
+    Checkpoint_Header header;
+    header.w = (uint32_t)out_w;
+    header.h = (uint32_t)out_h;
+    header.samples = (uint32_t)n_samples;
+    header.area_samples = (uint32_t)n_area_samples;
+    header.depth = (uint32_t)max_depth;
+    header.light_sampling = (uint32_t)light_sampling;
+    header.light_samples = (uint32_t)n_light_samples;
+    header.integrator = (uint32_t)integrator;
+    header.shard_mode = (uint32_t)shard_mode;
+    header.shard = (uint32_t)shard;
+    header.shards = (uint32_t)n_shards;
+    header.env_format = (uint32_t)env_format;
+    header.seed = RNG::get_render_seed();
+    return header;
+}
+
+std::string Pathtracer::save_checkpoint(std::string file) {
+
+    if(window_rows != out_h) return "Checkpoints need the whole image in the window!";
+
+    // Only the epochs already folded into the accumulator are saved. Epochs
+    // that finished out of order are traced again after resuming, which gives
+    // the same samples because each (pixel, sample) has its own RNG stream.
+    Checkpoint_Header header = checkpoint_header();
+    std::vector<float> data(out_w * out_h * 4);
+    std::vector<uint32_t> counts;
+    {
+        std::lock_guard<std::mutex> lock(accumulator_mut);
+        header.epochs = next_epoch;
+        const HDR_Image& image = accumulator;
+        for(size_t i = 0; i < out_w * out_h; i++) {
+            Spectrum s = image.at(i);
+            data[4 * i] = s.r;
+            data[4 * i + 1] = s.g;
+            data[4 * i + 2] = s.b;
+            data[4 * i + 3] = accumulator_luma2[i];
+        }
+        counts = accumulator_counts;
+    }
+
+    // Write to a temporary file first so a preempted write can't destroy
+    // the previous checkpoint
+    std::string temp = file + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary);
+        if(!out.is_open()) return "Failed to open " + temp + "!";
+        out.write((const char*)&header, sizeof(header));
+        out.write((const char*)data.data(), data.size() * sizeof(float));
+        out.write((const char*)counts.data(), counts.size() * sizeof(uint32_t));
+        if(!out.good()) return "Failed to write " + temp + "!";
+    }
+#ifdef _WIN32
+    std::remove(file.c_str());
+#endif
+    if(std::rename(temp.c_str(), file.c_str()) != 0) return "Failed to write " + file + "!";
+    return {};
+}
+
+std::string Pathtracer::resume_render(Scene& layout_scene, const Camera& cam, std::string file) {
+
+    cancel();
+    allocate();
+    if(window_rows != out_h) return "Checkpoints need the whole image in the window!";
+
+    std::ifstream in(file, std::ios::binary);
+    if(!in.is_open()) return "Failed to open " + file + "!";
+
+    Checkpoint_Header header;
+    in.read((char*)&header, sizeof(header));
+    if(!in.good()) return "Failed to read " + file + "!";
+
+    if(!(header == checkpoint_header())) {
+        return "Checkpoint " + file + " has different render settings!";
+    }
+
+    std::vector<float> data(out_w * out_h * 4);
+    std::vector<uint32_t> counts(out_w * out_h);
+    in.read((char*)data.data(), data.size() * sizeof(float));
+    in.read((char*)counts.data(), counts.size() * sizeof(uint32_t));
+    if(!in.good()) return "Failed to read " + file + "!";
+
+    build_time = SDL_GetPerformanceCounter();
+    build_scene(layout_scene);
+    build_time = SDL_GetPerformanceCounter() - build_time;
+
+    for(size_t i = 0; i < out_w * out_h; i++) {
+        accumulator.at(i) = Spectrum(data[4 * i], data[4 * i + 1], data[4 * i + 2]);
+        accumulator_luma2[i] = data[4 * i + 3];
+    }
+    accumulator_counts = std::move(counts);
+    accumulator_samples = header.epochs;
+    traced_samples = 0;
+    publish(accumulator);
+
+    camera = cam;
+    enqueue_epochs(header.epochs);
+    return {};
+}
+
+std::string Pathtracer::save_exr(std::string file) {
+    return EXR::write(file, out_w, window_rows, exr_channels());
+}
+
+std::vector<EXR::Channel> Pathtracer::exr_channels() {
+
+    // EXR rows go top to bottom, the accumulator's bottom to top
+    size_t rows = window_rows;
+    auto plane = [this, rows](auto&& value) {
+        std::vector<float> data(out_w * rows);
+        for(size_t j = 0; j < rows; j++) {
+            for(size_t i = 0; i < out_w; i++) {
+                data[j * out_w + i] = value((rows - j - 1) * out_w + i);
+            }
+        }
+        return data;
+    };
+
+    std::vector<EXR::Channel> channels;
+    {
+        std::lock_guard<std::mutex> lock(accumulator_mut);
+        const HDR_Image& image = has_denoised ? denoised : accumulator;
+        channels.push_back({"R", plane([&](size_t i) { return image.at(i).r; })});
+        channels.push_back({"G", plane([&](size_t i) { return image.at(i).g; })});
+        channels.push_back({"B", plane([&](size_t i) { return image.at(i).b; })});
+        if(has_denoised) {
+            channels.push_back({"noisy.R", plane([&](size_t i) { return accumulator.at(i).r; })});
+            channels.push_back({"noisy.G", plane([&](size_t i) { return accumulator.at(i).g; })});
+            channels.push_back({"noisy.B", plane([&](size_t i) { return accumulator.at(i).b; })});
+        }
+        channels.push_back(
+            {"samples", plane([&](size_t i) { return (float)accumulator_counts[i]; })});
+    }
+
+    if(collect_aovs) {
+        channels.push_back({"Z", plane([&](size_t i) { return aovs.depth[i]; })});
+        channels.push_back({"N.X", plane([&](size_t i) { return aovs.normal[i].x; })});
+        channels.push_back({"N.Y", plane([&](size_t i) { return aovs.normal[i].y; })});
+        channels.push_back({"N.Z", plane([&](size_t i) { return aovs.normal[i].z; })});
+        channels.push_back({"albedo.R", plane([&](size_t i) { return aovs.albedo[i].r; })});
+        channels.push_back({"albedo.G", plane([&](size_t i) { return aovs.albedo[i].g; })});
+        channels.push_back({"albedo.B", plane([&](size_t i) { return aovs.albedo[i].b; })});
+        channels.push_back({"id", plane([&](size_t i) { return aovs.id[i]; })});
+    }
+    return channels;
+}
+
+struct Partial_Header {
+    char magic[8] = {'C', '3', 'D', 'P', 'A', 'R', 'T', '1'};
+    uint32_t w = 0, h = 0;
+    uint32_t shard_mode = 0, shard = 0, shards = 1, samples = 0;
+};
+
+std::string Pathtracer::save_partial(std::string file) {
+
+    if(window_rows != out_h) return "Partial renders need the whole image in the window!";
+
+    Partial_Header header;
+    header.w = (uint32_t)out_w;
+    header.h = (uint32_t)out_h;
+    header.shard_mode = (uint32_t)shard_mode;
+    header.shard = (uint32_t)shard;
+    header.shards = (uint32_t)n_shards;
+    header.samples = (uint32_t)n_samples;
+
+    std::vector<float> data(out_w * out_h * 3);
+    std::vector<uint32_t> counts;
+    {
+        std::lock_guard<std::mutex> lock(accumulator_mut);
+        const HDR_Image& image = accumulator;
+        for(size_t i = 0; i < out_w * out_h; i++) {
+            Spectrum s = image.at(i);
+            data[3 * i] = s.r;
+            data[3 * i + 1] = s.g;
+            data[3 * i + 2] = s.b;
+        }
+        counts = accumulator_counts;
+    }
+
+    std::ofstream out(file, std::ios::binary);
+    if(!out.is_open()) return "Failed to open " + file + "!";
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)data.data(), data.size() * sizeof(float));
+    out.write((const char*)counts.data(), counts.size() * sizeof(uint32_t));
+    if(!out.good()) return "Failed to write " + file + "!";
+    return {};
+}
+
+std::string Pathtracer::merge_partials(const std::vector<std::string>& files, HDR_Image& image) {
+
+    if(files.empty()) return "No partial renders to merge!";
+
+    Partial_Header first;
+    std::vector<Spectrum> sums;
+    std::vector<uint64_t> counts;
+    std::vector<bool> seen;
+
+    for(const std::string& file : files) {
+
+        std::ifstream in(file, std::ios::binary);
+        if(!in.is_open()) return "Failed to open " + file + "!";
+
+        Partial_Header header;
+        in.read((char*)&header, sizeof(header));
+        if(!in.good() || std::memcmp(header.magic, first.magic, sizeof(first.magic)) != 0) {
+            return file + " is not a partial render!";
+        }
+
+        if(sums.empty()) {
+            first = header;
+            sums.resize((size_t)header.w * header.h);
+            counts.resize(sums.size(), 0);
+            seen.resize(header.shards, false);
+        } else if(header.w != first.w || header.h != first.h ||
+                  header.shard_mode != first.shard_mode || header.shards != first.shards ||
+                  header.samples != first.samples) {
+            return file + " is from a different render!";
+        }
+        if(header.shard >= header.shards || seen[header.shard]) {
+            return file + " repeats shard " + std::to_string(header.shard) + "!";
+        }
+        seen[header.shard] = true;
+
+        std::vector<float> data(sums.size() * 3);
+        std::vector<uint32_t> shard_counts(sums.size());
+        in.read((char*)data.data(), data.size() * sizeof(float));
+        in.read((char*)shard_counts.data(), shard_counts.size() * sizeof(uint32_t));
+        if(!in.good()) return "Failed to read " + file + "!";
+
+        // Weight each shard's mean by the samples it traced
+        for(size_t i = 0; i < sums.size(); i++) {
+            Spectrum s(data[3 * i], data[3 * i + 1], data[3 * i + 2]);
+            sums[i] += s * (float)shard_counts[i];
+            counts[i] += shard_counts[i];
+        }
+    }
+
+    for(size_t s = 0; s < seen.size(); s++) {
+        if(!seen[s]) return "Missing shard " + std::to_string(s) + "!";
+    }
+
+    image.resize(first.w, first.h);
+    for(size_t i = 0; i < sums.size(); i++) {
+        if(counts[i]) image.at(i) = sums[i] * (1.0f / counts[i]);
+    }
+    return {};
 }
 
 void Pathtracer::cancel() {
+
+    // Workers stay alive: pending epochs are dropped, and the ones in flight
+    // stop at their next scanline
     cancel_flag = true;
-    thread_pool.clear();
+    tasks.clear();
+    tasks.wait();
     completed_epochs = 0;
     total_epochs = 0;
+    pending_epochs.clear();
     cancel_flag = false;
     build_time = 0;
     render_time = SDL_GetPerformanceCounter() - render_time;
 }
 
 const HDR_Image& Pathtracer::get_output() {
-    return accumulator;
+    return has_denoised ? denoised : accumulator;
 }
 
 const GL::Tex2D& Pathtracer::get_output_texture(float exposure) {
-    std::lock_guard<std::mutex> lock(accumulator_mut);
-    return accumulator.get_texture(exposure);
+    return display.get_texture(exposure);
 }
 
 } // namespace PT
@@ -2,17 +2,23 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
 #include <mutex>
 #include <unordered_map>
 
 #include "../lib/mathlib.h"
 #include "../scene/scene.h"
+#include "../util/display_buffer.h"
+#include "../util/exr.h"
 #include "../util/hdr_image.h"
 #include "../util/thread_pool.h"
 
 #include "bsdf.h"
 #include "env_light.h"
 #include "light.h"
+#include "light_tree.h"
 #include "object.h"
 
 namespace Gui {
@@ -21,40 +27,189 @@ class Widget_Render;
 
 namespace PT {
 
+// How next-event estimation picks lights at each hit
+enum class Light_Sampling : int { all, power, tree, count };
+extern const char* Light_Sampling_Names[(int)Light_Sampling::count];
+
+// How a render is split between processes (see Pathtracer::set_shard)
+enum class Shard_Mode : int { rows, samples, count };
+extern const char* Shard_Mode_Names[(int)Shard_Mode::count];
+
+// Path tracing estimator used for each camera ray
+enum class Integrator : int { path, mis, count };
+extern const char* Integrator_Names[(int)Integrator::count];
+
+// A light to sample at a hit, as chosen by Pathtracer::select_lights. When
+// the light was picked at random, rate is the expected number of times it
+// is picked per hit, and the pdf of its samples includes it, so each choice
+// can be sampled as if it were the only light in the scene.
+struct Light_Choice {
+
+    Light_Sample sample(Vec3 from) const {
+        Light_Sample ret = light ? light->sample(from) : env->sample(from);
+        ret.pdf *= rate;
+        return ret;
+    }
+    bool is_discrete() const {
+        return light && light->is_discrete();
+    }
+
+    const Light* light = nullptr;
+    const Env_Light* env = nullptr; // used if light is null
+    float rate = 1.0f;
+};
+
 class Pathtracer {
 public:
     Pathtracer(Gui::Widget_Render& gui, Vec2 screen_dim);
     ~Pathtracer();
 
     void set_sizes(size_t w, size_t h, size_t pixel_samples, size_t area_samples, size_t depth);
+    void set_light_sampling(Light_Sampling mode, size_t samples);
+    void set_integrator(Integrator mode);
+    // Storage of environment maps; compact formats take effect on the next
+    // scene build and trade precision for memory
+    void set_env_format(Pixel_Format format);
+    // Only trace shard index of count: a band of rows, or a range of each
+    // pixel's samples. Shards are deterministic, so partial renders from
+    // several processes can be merged into the full image.
+    void set_shard(Shard_Mode mode, size_t index, size_t count);
+    // Also record depth, normal, albedo and object id of each pixel's first hit
+    void set_aovs(bool enable);
+    // Filter finished renders with an edge-aware denoiser guided by the AOVs
+    // (see denoise.h). The noisy image is kept for adding samples.
+    void set_denoise(bool enable);
+    // Only trace rows [begin, end) of the image, counted from the bottom, and
+    // only keep buffers for those rows. Clears the accumulated samples at the
+    // next render but keeps the scene, so begin_render(scene, camera, true)
+    // traces the new window without a rebuild. Tracing the image a window at
+    // a time gives the same pixels as tracing it whole. set_sizes resets the
+    // window.
+    void set_window(size_t row_begin, size_t row_end);
+    // Denoise the accumulator, if enabled and not already done. The output
+    // is the denoised image until the next render starts.
+    void denoise();
+    // Keep the tonemapped copy of the image get_output_texture shows. On by
+    // default; renders nobody watches turn it off to skip the copies.
+    void set_display(bool enable);
+    // Use the same sizes, sampling and output options as another pathtracer
+    void copy_settings(const Pathtracer& src);
 
     const HDR_Image& get_output();
     const GL::Tex2D& get_output_texture(float exposure);
     size_t visualize_bvh(GL::Lines& lines, GL::Lines& active, size_t level);
 
     void begin_render(Scene& scene, const Camera& camera, bool add_samples = false);
+    // Traces coarse 1 spp previews first, then refines at full resolution.
+    // Only rebuilds the scene if requested, so restarting on camera motion is cheap.
+    void begin_progressive(Scene& scene, const Camera& camera, bool rebuild);
+
+    // Checkpoints hold the epochs accumulated so far. Resuming with the same
+    // settings and scene traces the remaining epochs and gives the same image.
+    std::string save_checkpoint(std::string file);
+    std::string resume_render(Scene& scene, const Camera& camera, std::string file);
+
+    // Partial renders store the accumulated shard with per-pixel sample counts
+    std::string save_partial(std::string file);
+    static std::string merge_partials(const std::vector<std::string>& files, HDR_Image& image);
+
+    // Linear multi-channel EXR of the accumulator, sample counts and any AOVs
+    std::string save_exr(std::string file);
+    // The channels save_exr writes, for the rows in the window
+    std::vector<EXR::Channel> exr_channels();
+
     void cancel();
+    // Block until the render finishes or the timeout passes; true if finished
+    bool wait_for(std::chrono::milliseconds timeout);
     bool in_progress() const;
     float progress() const;
     std::pair<float, float> completion_time() const;
 
+    // Estimated relative standard error of the accumulated image, or infinity
+    // until enough epochs have been accumulated to tell
+    float relative_error();
+
 private:
     // Internal
     void build_scene(Scene& scene);
     void build_lights(Scene& scene, std::vector<Object>& objs);
-    void do_trace(size_t samples);
-    void accumulate(const HDR_Image& sample);
+    void build_light_tables();
+    void do_trace(size_t epoch, size_t first_sample, size_t samples);
+    void do_preview(size_t scale);
+    void do_aovs();
+    void enqueue_epochs(size_t first_epoch = 0);
+    std::pair<size_t, size_t> shard_range(size_t n) const;
+    // Image rows traced by this pathtracer, given the window and shard
+    std::pair<size_t, size_t> traced_rows() const;
+
+    struct Checkpoint_Header;
+    Checkpoint_Header checkpoint_header() const;
+
+    struct Epoch {
+        HDR_Image image;
+        std::vector<uint32_t> samples; // valid samples per pixel
+    };
+    void accumulate(size_t epoch, Epoch&& sample);
+    void reset_accumulator();
+    // Size the pixel buffers to the window, if it changed
+    void allocate();
     bool tonemap();
+    // Copy rows of an image to the display, if it is kept
+    void publish(const HDR_Image& image, size_t row_begin, size_t row_end);
+    void publish(const HDR_Image& image);
 
     Gui::Widget_Render& gui;
     unsigned long long render_time, build_time;
-    Thread_Pool thread_pool;
-    bool cancel_flag = false;
+    // Build and render tasks, on the pool shared with other pathtracers
+    Task_Group tasks;
+    // Checked by render tasks once per scanline
+    std::atomic<bool> cancel_flag{false};
 
     HDR_Image accumulator;
+    std::vector<float> accumulator_luma2; // per-pixel mean of squared epoch luma
+    std::vector<uint32_t> accumulator_counts; // per-pixel valid samples
     std::mutex accumulator_mut;
+    // What the UI shows. Written while holding accumulator_mut, but read
+    // without it, so tonemapping never stalls the render.
+    Display_Buffer display;
+    bool show_display = true;
     size_t total_epochs, accumulator_samples;
     std::atomic<size_t> completed_epochs;
+    std::mutex finished_mut;
+    std::condition_variable finished;
+
+    // Epochs are folded into the accumulator in order, so the result does
+    // not depend on which thread finishes first
+    std::map<size_t, Epoch> pending_epochs;
+    size_t next_epoch = 0, traced_samples = 0;
+    // Pixel block size of the preview shown in the accumulator (0 if none)
+    size_t preview_scale = 0;
+
+    // Auxiliary buffers, from one ray through each pixel center
+    struct AOVs {
+        std::vector<float> depth, id;
+        std::vector<Vec3> normal;
+        std::vector<Spectrum> albedo;
+    };
+    AOVs aovs;
+    bool collect_aovs = false;
+
+    HDR_Image denoised;
+    bool denoise_output = false, has_denoised = false;
+
+    // Lights to sample from the point from, as picked by light_sampling: every
+    // light, or n_light_samples random picks plus any lights at infinity the
+    // picks can't reach. The list is reused by the next call on this thread.
+    const std::vector<Light_Choice>& select_lights(Vec3 from) const;
+
+    // Combines light and BSDF sampling with power heuristic weights
+    Spectrum trace_ray_mis(const Ray& ray);
+    // A camera ray through a random point of the pixel, traced with
+    // trace_ray_mis; stands in for trace_pixel with Integrator::mis
+    Spectrum trace_pixel_mis(size_t x, size_t y);
+    // One sample of pixel (x, y) with the selected integrator
+    Spectrum trace_sample(size_t x, size_t y);
+    float light_rate(size_t light, Vec3 from) const;
 
     /// Relevant to student
     Spectrum trace_pixel(size_t x, size_t y);
@@ -63,12 +218,34 @@ private:
 
     BVH<Object> scene;
     std::vector<Light> lights;
+    // Emissive objects. The MIS integrator also samples them as lights,
+    // weighted against hitting them by BSDF sampling, so they are moved to
+    // the end of lights while it is selected. The path integrator adds their
+    // emission at every hit, and sampling them too would count it twice.
+    std::vector<Light> emissive_lights;
+    size_t n_scene_lights = 0;
+    Integrator tables_integrator = Integrator::path;
+    Light_Tree light_tree;
+    Alias_Table light_power; // over lights, then env_light
+    std::unordered_map<unsigned int, size_t> emitter_lights; // material -> light
     std::vector<BSDF> materials;
     std::optional<Env_Light> env_light; // only one of these per scene
     std::unordered_map<Scene_ID, size_t> mat_cache;
+    std::unordered_map<Scene_ID, uint64_t> mesh_versions; // geometry_id of each built mesh
 
     Camera camera;
     size_t out_w, out_h, n_samples, n_area_samples, max_depth;
+    // Rows of the image held in the pixel buffers (see set_window)
+    size_t window_begin = 0, window_rows = 0;
+    bool resized = false;
+
+    Light_Sampling light_sampling = Light_Sampling::all;
+    size_t n_light_samples = 1;
+    Integrator integrator = Integrator::path;
+    Pixel_Format env_format = Pixel_Format::rgb32f;
+
+    Shard_Mode shard_mode = Shard_Mode::rows;
+    size_t shard = 0, n_shards = 1;
 };
 
 } // namespace PT
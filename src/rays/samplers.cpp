@@ -0,0 +1,96 @@
+#include "samplers.h"
+#include "../util/rand.h"
+
+namespace Samplers {
+
+float Hemisphere::Uniform::pdf(Vec3 dir) const {
+    return dir.y > 0.0f ? 1.0f / (2.0f * PI_F) : 0.0f;
+}
+
+float Hemisphere::Cosine::pdf(Vec3 dir) const {
+    return dir.y > 0.0f ? dir.y / PI_F : 0.0f;
+}
+
+float Sphere::Uniform::pdf(Vec3) const {
+    return 1.0f / (4.0f * PI_F);
+}
+
+Vec2 Sphere::Alias_Image::dir_to_uv(Vec3 dir) {
+    float theta = std::acos(clamp(dir.y, -1.0f, 1.0f));
+    float phi = std::atan2(dir.z, dir.x);
+    if(phi < 0.0f) phi += 2.0f * PI_F;
+    return Vec2(phi / (2.0f * PI_F), 1.0f - theta / PI_F);
+}
+
+Vec3 Sphere::Alias_Image::uv_to_dir(Vec2 uv) {
+    float theta = PI_F * (1.0f - uv.y);
+    float phi = 2.0f * PI_F * uv.x;
+    float sin_theta = std::sin(theta);
+    return Vec3(sin_theta * std::cos(phi), std::cos(theta), sin_theta * std::sin(phi));
+}
+
+Sphere::Alias_Image::Alias_Image(const HDR_Image& image) {
+
+    const auto [_w, _h] = image.dimension();
+    w = _w;
+    h = _h;
+
+    // Weight each texel by the solid angle it covers
+    std::vector<float> rows(h), texels(w);
+    conditional.resize(h);
+    for(size_t j = 0; j < h; j++) {
+        float sin_theta = std::sin(PI_F * (j + 0.5f) / h);
+        float sum = 0.0f;
+        for(size_t i = 0; i < w; i++) {
+            texels[i] = image.at(i, j).luma() * sin_theta;
+            sum += texels[i];
+        }
+        conditional[j].build(texels);
+        rows[j] = sum;
+    }
+    marginal.build(rows);
+}
+
+Vec3 Sphere::Alias_Image::sample(float& out_pdf) const {
+
+    // A black or empty map has nothing to importance sample: pick a uniformly
+    // random direction instead, matching what pdf() reports for it
+    if(marginal.empty()) {
+        float y = 1.0f - 2.0f * RNG::unit();
+        float r = std::sqrt(std::max(0.0f, 1.0f - y * y));
+        float phi = 2.0f * PI_F * RNG::unit();
+        out_pdf = 1.0f / (4.0f * PI_F);
+        return Vec3(r * std::cos(phi), y, r * std::sin(phi));
+    }
+
+    float row_pmf, col_pmf;
+    size_t j = marginal.sample(row_pmf);
+    size_t i = conditional[j].sample(col_pmf);
+
+    // Uniform within the chosen texel
+    Vec2 uv((i + RNG::unit()) / w, (j + RNG::unit()) / h);
+    Vec3 dir = uv_to_dir(uv);
+
+    float sin_theta = std::sqrt(std::max(0.0f, 1.0f - dir.y * dir.y));
+    if(sin_theta <= 0.0f) {
+        out_pdf = 0.0f;
+        return dir;
+    }
+    out_pdf = row_pmf * col_pmf * (w * h) / (2.0f * PI_F * PI_F * sin_theta);
+    return dir;
+}
+
+float Sphere::Alias_Image::pdf(Vec3 dir) const {
+
+    if(marginal.empty()) return 1.0f / (4.0f * PI_F);
+
+    Vec2 uv = dir_to_uv(dir);
+    size_t i = std::min((size_t)(uv.x * w), w - 1);
+    size_t j = std::min((size_t)(uv.y * h), h - 1);
+
+    float sin_theta = std::sqrt(std::max(0.0f, 1.0f - dir.y * dir.y));
+    if(sin_theta <= 0.0f) return 0.0f;
+    return marginal.pmf(j) * conditional[j].pmf(i) * (w * h) / (2.0f * PI_F * PI_F * sin_theta);
+}
+
+} // namespace Samplers
@@ -2,6 +2,7 @@
 #pragma once
 
 #include "../lib/mathlib.h"
+#include "../util/alias_table.h"
 #include "../util/hdr_image.h"
 
 namespace Samplers {
@@ -45,11 +46,13 @@ namespace Hemisphere {
 struct Uniform {
     Uniform() = default;
     Vec3 sample(float& pdf) const;
+    float pdf(Vec3 dir) const;
 };
 
 struct Cosine {
     Cosine() = default;
     Vec3 sample(float& pdf) const;
+    float pdf(Vec3 dir) const;
 };
 } // namespace Hemisphere
 
@@ -58,6 +61,7 @@ namespace Sphere {
 struct Uniform {
     Uniform() = default;
     Vec3 sample(float& pdf) const;
+    float pdf(Vec3 dir) const;
     Hemisphere::Uniform hemi;
 };
 
@@ -70,5 +74,23 @@ struct Image {
     float total = 0.0f;
 };
 
+// Importance samples an equirectangular map for the renderer's environment
+// maps: a marginal alias table picks the row, then that row's conditional
+// table picks the column, both in O(1)
+struct Alias_Image {
+    Alias_Image() = default;
+    Alias_Image(const HDR_Image& image);
+    Vec3 sample(float& pdf) const;
+    float pdf(Vec3 dir) const;
+
+    // Equirectangular mapping; v = 1 is straight up (+y)
+    static Vec2 dir_to_uv(Vec3 dir);
+    static Vec3 uv_to_dir(Vec2 uv);
+
+    size_t w = 0, h = 0;
+    Alias_Table marginal;
+    std::vector<Alias_Table> conditional;
+};
+
 } // namespace Sphere
 } // namespace Samplers
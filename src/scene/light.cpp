@@ -2,6 +2,7 @@
 #include "light.h"
 
 #include "../geometry/util.h"
+#include "../util/thread_pool.h"
 #include "renderer.h"
 
 #include <sstream>
@@ -45,7 +46,12 @@ HDR_Image Scene_Light::emissive_copy() const {
     return _emissive.copy();
 }
 
+uint64_t Scene_Light::emissive_id() const {
+    return _emissive.content_id();
+}
+
 std::string Scene_Light::emissive_load(std::string file) {
+    _emissive_loading = {};
     std::string err = _emissive.load_from(file);
     if(err.empty()) {
         opt.has_emissive_map = true;
@@ -53,6 +59,40 @@ std::string Scene_Light::emissive_load(std::string file) {
     return err;
 }
 
+void Scene_Light::emissive_load_async(std::string file) {
+
+    // The task doesn't refer to the light, so the light may be moved or
+    // destroyed while it runs. A newer load replaces an unfinished one.
+    auto result = std::make_shared<std::promise<std::pair<HDR_Image, std::string>>>();
+    _emissive_loading = result->get_future();
+
+    Thread_Pool::get().enqueue([result, file = std::move(file)]() {
+        HDR_Image image;
+        std::string err = image.load_from(file);
+        result->set_value({std::move(image), std::move(err)});
+    });
+}
+
+bool Scene_Light::emissive_loading() const {
+    return _emissive_loading.valid();
+}
+
+bool Scene_Light::emissive_update(std::string& err) {
+
+    if(!_emissive_loading.valid() ||
+       _emissive_loading.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return false;
+    }
+
+    auto [image, error] = _emissive_loading.get();
+    if(error.empty()) {
+        _emissive = std::move(image);
+        opt.has_emissive_map = true;
+    }
+    err = std::move(error);
+    return true;
+}
+
 std::string Scene_Light::emissive_loaded() const {
     return _emissive.loaded_from();
 }
@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include <future>
 #include <string>
 
 #include "../lib/spectrum.h"
@@ -34,8 +35,16 @@ public:
     void set_time(float time);
 
     std::string emissive_load(std::string file);
+    // Decode the map on the shared thread pool. The current map stays in use
+    // until emissive_update finds the load finished.
+    void emissive_load_async(std::string file);
+    bool emissive_loading() const;
+    // True once a background load has finished; on success the new map
+    // replaces the old one, otherwise err says why it failed
+    bool emissive_update(std::string& err);
     std::string emissive_loaded() const;
     HDR_Image emissive_copy() const;
+    uint64_t emissive_id() const;
 
     const GL::Tex2D& emissive_texture() const;
     void emissive_clear();
@@ -71,6 +80,7 @@ private:
     GL::Mesh _mesh;
     GL::Lines _lines;
     HDR_Image _emissive;
+    std::future<std::pair<HDR_Image, std::string>> _emissive_loading;
 };
 
 bool operator!=(const Scene_Light::Options& l, const Scene_Light::Options& r);
@@ -1,4 +1,5 @@
 
+#include <atomic>
 #include <sstream>
 
 #include "object.h"
@@ -70,6 +71,7 @@ void Scene_Object::try_make_editable(PT::Shape_Type prev) {
 
     mesh_dirty = true;
     skel_dirty = true;
+    geometry_stale = true;
 }
 
 bool Scene_Object::is_shape() const {
@@ -142,6 +144,7 @@ void Scene_Object::sync_anim_mesh() {
 void Scene_Object::flip_normals() {
     halfedge.flip();
     mesh_dirty = true;
+    geometry_stale = true;
 }
 
 void Scene_Object::sync_mesh() {
@@ -156,11 +159,13 @@ void Scene_Object::sync_mesh() {
 
 void Scene_Object::set_pose_dirty() {
     pose_dirty = true;
+    geometry_stale = true;
 }
 
 void Scene_Object::set_skel_dirty() {
     skel_dirty = true;
     pose_dirty = true;
+    geometry_stale = true;
 }
 
 void Scene_Object::set_mesh_dirty() {
@@ -168,6 +173,16 @@ void Scene_Object::set_mesh_dirty() {
     mesh_dirty = true;
     skel_dirty = true;
     pose_dirty = true;
+    geometry_stale = true;
+}
+
+uint64_t Scene_Object::geometry_id() const {
+    static std::atomic<uint64_t> next_id{1};
+    if(geometry_stale) {
+        geometry = next_id++;
+        geometry_stale = false;
+    }
+    return geometry;
 }
 
 BBox Scene_Object::bbox() {
@@ -51,6 +51,9 @@ public:
     void set_skel_dirty();
     void set_pose_dirty();
 
+    // Changes whenever posed_mesh() may have changed (pose transform excluded)
+    uint64_t geometry_id() const;
+
     static const inline int max_name_len = 256;
     struct Options {
         char name[max_name_len] = {};
@@ -77,6 +80,8 @@ private:
     mutable bool editable = true;
     mutable bool mesh_dirty = false;
     mutable bool skel_dirty = false, pose_dirty = false;
+    mutable uint64_t geometry = 0;
+    mutable bool geometry_stale = true;
 };
 
 bool operator!=(const Scene_Object::Options& l, const Scene_Object::Options& r);
@@ -163,16 +163,53 @@ Scene_ID Scene::add(Pose pose, GL::Mesh&& mesh, std::string n, Scene_ID id) {
     return id;
 }
 
-std::string Scene::set_env_map(std::string file) {
+void Scene::replace_env_light(Scene_Light&& light) {
     Scene_ID id = 0;
     for_items([&id](const Scene_Item& item) {
         if(item.is<Scene_Light>() && item.get<Scene_Light>().is_env()) id = item.id();
     });
+    if(id) erase(id);
+    add(std::move(light));
+}
+
+std::string Scene::set_env_map(std::string file) {
+    env_loading.reset();
     Scene_Light l(Light_Type::sphere, reserve_id(), {}, "env_map");
     std::string err = l.emissive_load(file);
-    if(err.empty()) {
-        if(id) erase(id);
-        add(std::move(l));
+    if(err.empty()) replace_env_light(std::move(l));
+    return err;
+}
+
+void Scene::set_env_map_async(std::string file) {
+    Scene_Light l(Light_Type::sphere, reserve_id(), {}, "env_map");
+    l.emissive_load_async(std::move(file));
+    env_loading = std::move(l);
+}
+
+std::string Scene::pump_loads(std::function<void(Scene_Light&, Scene_Light::Options)> started) {
+
+    std::string err, load_err;
+    for(auto& entry : objs) {
+        Scene_Item& item = entry.second;
+        if(!item.is<Scene_Light>()) continue;
+
+        Scene_Light& light = item.get<Scene_Light>();
+        Scene_Light::Options old_opt = light.opt;
+        if(!light.emissive_update(load_err)) continue;
+        if(!load_err.empty()) {
+            err = load_err;
+        } else if(!old_opt.has_emissive_map) {
+            started(light, old_opt);
+        }
+    }
+
+    if(env_loading && env_loading->emissive_update(load_err)) {
+        if(load_err.empty()) {
+            replace_env_light(std::move(*env_loading));
+        } else {
+            err = load_err;
+        }
+        env_loading.reset();
     }
     return err;
 }
@@ -279,6 +316,7 @@ Scene_Particles& Scene::get_particles(Scene_ID id) {
 
 void Scene::clear(Undo& undo) {
     next_id = first_id;
+    env_loading.reset();
     objs.clear();
     erased.clear();
     undo.reset();
@@ -104,6 +104,13 @@ public:
     Scene_Light& get_light(Scene_ID id);
     Scene_Particles& get_particles(Scene_ID id);
     std::string set_env_map(std::string file);
+    // As set_env_map, but the image is decoded in the background and the
+    // current environment light stays until pump_loads swaps in the new one
+    void set_env_map_async(std::string file);
+    // Use any images that finished loading in the background; returns the
+    // error of a failed load, if there was one. Lights that start using a map
+    // are passed to started with their options from before, e.g. for undo.
+    std::string pump_loads(std::function<void(Scene_Light&, Scene_Light::Options)> started);
 
     bool has_env_light() const;
     bool has_obj() const;
@@ -120,7 +127,9 @@ private:
         unsigned int nodes = 0;
     };
     Stats get_stats(const Gui::Animate& animation);
+    void replace_env_light(Scene_Light&& light);
 
+    std::optional<Scene_Light> env_loading;
     std::map<Scene_ID, Scene_Item> objs;
     std::map<Scene_ID, Scene_Item> erased;
     Scene_ID next_id, first_id;
@@ -31,7 +31,7 @@ Spectrum Pathtracer::trace_ray(const Ray& ray) {
     Trace hit = scene.hit(ray);
     if(!hit.hit) {
         if(env_light.has_value()) {
-            return env_light.value().sample_direction(ray.dir);
+            return env_light.value().sample_direction(ray.dir, ray.spread);
         }
         return {};
     }
@@ -103,8 +103,8 @@ Spectrum Pathtracer::trace_ray(const Ray& ray) {
         // If the BSDF is discrete (i.e. uses dirac deltas/if statements), then we are never
         // going to hit the exact right direction by sampling lights, so ignore them.
         if(!bsdf.is_discrete()) {
-            for(const auto& light : lights) sample_light(light);
-            if(env_light.has_value()) sample_light(env_light.value());
+            // Which lights, and how often, depends on light_sampling
+            for(const Light_Choice& light : select_lights(hit.position)) sample_light(light);
         }
     }
 
@@ -0,0 +1,101 @@
+
+#include "alias_table.h"
+#include "../lib/log.h"
+#include "rand.h"
+
+#include <algorithm>
+
+Alias_Table::Alias_Table(const std::vector<float>& weights) {
+    build(weights);
+}
+
+void Alias_Table::clear() {
+    bins.clear();
+    sum = 0.0f;
+}
+
+void Alias_Table::build(const std::vector<float>& weights) {
+
+    clear();
+    if(weights.empty()) return;
+
+    size_t n = weights.size();
+    bins.resize(n);
+
+    double total = 0.0;
+    for(float w : weights) total += std::max(w, 0.0f);
+    sum = (float)total;
+
+    // All-zero weights degrade to a uniform distribution
+    if(total <= 0.0) {
+        for(size_t i = 0; i < n; i++) bins[i] = {1.0f, (uint32_t)i, 1.0f / n};
+        return;
+    }
+
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    small.reserve(n);
+    large.reserve(n);
+
+    for(size_t i = 0; i < n; i++) {
+        double p = std::max(weights[i], 0.0f) / total;
+        bins[i].pmf = (float)p;
+        scaled[i] = p * n;
+        if(scaled[i] < 1.0)
+            small.push_back((uint32_t)i);
+        else
+            large.push_back((uint32_t)i);
+    }
+
+    while(!small.empty() && !large.empty()) {
+        uint32_t s = small.back(), l = large.back();
+        small.pop_back();
+
+        bins[s].prob = (float)scaled[s];
+        bins[s].alias = l;
+
+        scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+        if(scaled[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // Leftovers are 1 up to rounding error
+    for(uint32_t i : large) bins[i] = {1.0f, i, bins[i].pmf};
+    for(uint32_t i : small) bins[i] = {1.0f, i, bins[i].pmf};
+}
+
+size_t Alias_Table::sample(float& pmf) const {
+    float u_bin = RNG::unit();
+    float u_coin = RNG::unit();
+    return sample(u_bin, u_coin, pmf);
+}
+
+size_t Alias_Table::sample(float u_bin, float u_coin, float& pmf) const {
+
+    assert(!bins.empty());
+
+    size_t i = std::min((size_t)(u_bin * bins.size()), bins.size() - 1);
+    const Bin& bin = bins[i];
+    if(u_coin >= bin.prob) i = bin.alias;
+
+    pmf = bins[i].pmf;
+    return i;
+}
+
+float Alias_Table::pmf(size_t i) const {
+    return i < bins.size() ? bins[i].pmf : 0.0f;
+}
+
+float Alias_Table::total() const {
+    return sum;
+}
+
+size_t Alias_Table::size() const {
+    return bins.size();
+}
+
+bool Alias_Table::empty() const {
+    return bins.empty();
+}
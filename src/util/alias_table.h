@@ -0,0 +1,38 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Walker/Vose alias table: draws index i with probability weights[i] / sum
+// in constant time, independent of the number of entries.
+class Alias_Table {
+public:
+    Alias_Table() = default;
+    Alias_Table(const std::vector<float>& weights);
+
+    void build(const std::vector<float>& weights);
+    void clear();
+
+    // Draw an index and set pmf to its probability
+    size_t sample(float& pmf) const;
+    // Same, using the caller's uniform numbers in [0,1)
+    size_t sample(float u_bin, float u_coin, float& pmf) const;
+
+    float pmf(size_t i) const;
+    float total() const;
+    size_t size() const;
+    bool empty() const;
+
+private:
+    // Everything a sample needs lives in one bin, so a draw touches at most two
+    struct Bin {
+        float prob = 1.0f;
+        uint32_t alias = 0;
+        float pmf = 0.0f;
+    };
+
+    std::vector<Bin> bins;
+    float sum = 0.0f;
+};
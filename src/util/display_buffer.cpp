@@ -0,0 +1,86 @@
+
+#include "display_buffer.h"
+#include "../lib/log.h"
+
+#include <algorithm>
+
+void Display_Buffer::resize(size_t _w, size_t _h) {
+    w = _w;
+    h = _h;
+    tiles_x = (w + tile_size - 1) / tile_size;
+    tiles_y = (h + tile_size - 1) / tile_size;
+    tiles = std::make_unique<Tile[]>(tiles_x * tiles_y);
+    for(auto& buffer : buffers) buffer.assign(w * h, Spectrum{});
+    rgba.assign(w * h * 4, 0);
+    allocated = false;
+}
+
+void Display_Buffer::publish(const HDR_Image& image) {
+    publish(image, 0, h);
+}
+
+void Display_Buffer::publish(const HDR_Image& image, size_t row_begin, size_t row_end) {
+
+    assert(image.dimension() == std::make_pair(w, h));
+    row_end = std::min(row_end, h);
+
+    for(size_t ty = row_begin / tile_size; ty * tile_size < row_end; ty++) {
+        size_t y0 = ty * tile_size, y1 = std::min(y0 + tile_size, h);
+        for(size_t tx = 0; tx < tiles_x; tx++) {
+            size_t x0 = tx * tile_size, x1 = std::min(x0 + tile_size, w);
+
+            Tile& tile = tiles[ty * tiles_x + tx];
+            std::vector<Spectrum>& buffer = buffers[tile.write];
+            for(size_t j = y0; j < y1; j++) {
+                for(size_t i = x0; i < x1; i++) buffer[j * w + i] = image.at(i, j);
+            }
+            // Release the copy; take back whichever buffer was shared before
+            uint8_t prev = tile.shared.exchange(tile.write | fresh, std::memory_order_acq_rel);
+            tile.write = prev & ~fresh;
+        }
+    }
+}
+
+const GL::Tex2D& Display_Buffer::get_texture(float e) {
+
+    bool retonemap = !allocated;
+    if(e > 0.0f && e != exposure) {
+        exposure = e;
+        retonemap = true;
+    }
+
+    // Rows are flipped, as in HDR_Image::tonemap_to
+    size_t band_begin = h, band_end = 0;
+    for(size_t ty = 0; ty < tiles_y; ty++) {
+        size_t y0 = ty * tile_size, y1 = std::min(y0 + tile_size, h);
+        for(size_t tx = 0; tx < tiles_x; tx++) {
+            size_t x0 = tx * tile_size, x1 = std::min(x0 + tile_size, w);
+
+            Tile& tile = tiles[ty * tiles_x + tx];
+            bool changed = tile.shared.load(std::memory_order_relaxed) & fresh;
+            if(changed) {
+                uint8_t prev = tile.shared.exchange(tile.read, std::memory_order_acq_rel);
+                tile.read = prev & ~fresh;
+            }
+            if(!changed && !retonemap) continue;
+
+            const std::vector<Spectrum>& buffer = buffers[tile.read];
+            for(size_t j = y0; j < y1; j++) {
+                size_t row = h - j - 1;
+                HDR_Image::tonemap_row(&buffer[j * w + x0], x1 - x0, exposure,
+                                       &rgba[4 * (row * w + x0)]);
+            }
+            band_begin = std::min(band_begin, h - y1);
+            band_end = std::max(band_end, h - y0);
+        }
+    }
+
+    if(!allocated) {
+        tex.image((int)w, (int)h, rgba.data());
+        allocated = true;
+    } else if(band_begin < band_end) {
+        tex.sub_image(0, (int)band_begin, (int)w, (int)(band_end - band_begin),
+                      rgba.data() + 4 * band_begin * w);
+    }
+    return tex;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "../platform/gl.h"
+#include "hdr_image.h"
+
+// Tonemapped view of an image that is written on one thread and shown on
+// another. Each tile of the image is triple buffered: the writer fills its
+// own copy and swaps it with the shared one, and the display swaps the
+// shared one with its own when it is newer. Neither side ever waits on the
+// other, and the display only tonemaps the tiles that changed.
+class Display_Buffer {
+public:
+    static const size_t tile_size = 32;
+
+    Display_Buffer() = default;
+    Display_Buffer(const Display_Buffer&) = delete;
+    Display_Buffer& operator=(const Display_Buffer&) = delete;
+
+    // Not thread safe; there must be no writer or display running
+    void resize(size_t w, size_t h);
+
+    // Copy the tiles overlapping rows [row_begin, row_end) of the image, which
+    // must have the buffer's size. Only one thread may publish at a time.
+    void publish(const HDR_Image& image, size_t row_begin, size_t row_end);
+    void publish(const HDR_Image& image);
+
+    // Tonemap the tiles published since the last call and upload them. Must
+    // be called from the thread owning the GL context.
+    const GL::Tex2D& get_texture(float exposure = 0.0f);
+
+private:
+    static const uint8_t fresh = 4;
+
+    struct Tile {
+        // Index of the writer's, the shared and the display's buffer. The
+        // shared index has the fresh bit set until the display takes it.
+        uint8_t write = 0, read = 2;
+        std::atomic<uint8_t> shared{1};
+    };
+
+    size_t w = 0, h = 0, tiles_x = 0, tiles_y = 0;
+    std::unique_ptr<Tile[]> tiles;
+    std::vector<Spectrum> buffers[3];
+
+    // Display side
+    GL::Tex2D tex;
+    std::vector<unsigned char> rgba;
+    float exposure = 1.0f;
+    bool allocated = false;
+};
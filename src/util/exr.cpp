@@ -0,0 +1,245 @@
+
+#include "exr.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sf_libs/tinyexr.h>
+
+namespace EXR {
+
+std::string write(std::string file, size_t w, size_t h, std::vector<Channel> channels) {
+
+    // Readers expect channels sorted by name
+    std::sort(channels.begin(), channels.end(),
+              [](const Channel& l, const Channel& r) { return l.name < r.name; });
+
+    std::vector<EXRChannelInfo> infos(channels.size());
+    std::vector<int> types(channels.size(), TINYEXR_PIXELTYPE_FLOAT);
+    std::vector<unsigned char*> images(channels.size());
+
+    for(size_t c = 0; c < channels.size(); c++) {
+        if(channels[c].data.size() != w * h) {
+            return "Channel " + channels[c].name + " has the wrong size!";
+        }
+        std::memset(&infos[c], 0, sizeof(EXRChannelInfo));
+        std::strncpy(infos[c].name, channels[c].name.c_str(), sizeof(infos[c].name) - 1);
+        images[c] = (unsigned char*)channels[c].data.data();
+    }
+
+    EXRHeader header;
+    InitEXRHeader(&header);
+    header.num_channels = (int)channels.size();
+    header.channels = infos.data();
+    header.pixel_types = types.data();
+    header.requested_pixel_types = types.data();
+    header.compression_type = TINYEXR_COMPRESSIONTYPE_ZIP;
+
+    EXRImage image;
+    InitEXRImage(&image);
+    image.num_channels = (int)channels.size();
+    image.images = images.data();
+    image.width = (int)w;
+    image.height = (int)h;
+
+    const char* err = nullptr;
+    if(SaveEXRImageToFile(&image, &header, file.c_str(), &err) != TINYEXR_SUCCESS) {
+        if(err) {
+            std::string err_s(err);
+            FreeEXRErrorMessage(err);
+            return err_s;
+        }
+        return "Unknown failure.";
+    }
+    return {};
+}
+
+namespace {
+
+// EXR files are little endian, as are the hosts we build for
+template<typename T> void put(std::string& out, T value) {
+    out.append((const char*)&value, sizeof(T));
+}
+
+void put_attribute(std::string& out, const char* name, const char* type, const std::string& value) {
+    out.append(name, std::strlen(name) + 1);
+    out.append(type, std::strlen(type) + 1);
+    put(out, (int32_t)value.size());
+    out += value;
+}
+
+template<typename T> T get(const unsigned char* data) {
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+} // namespace
+
+Stream_Writer::~Stream_Writer() {
+    if(out.is_open()) close();
+}
+
+std::string Stream_Writer::open(std::string file, size_t _w, size_t _h,
+                                std::vector<std::string> channels) {
+
+    if(out.is_open()) return "Stream writer is already open!";
+    if(_w == 0 || _h == 0) return "Image is empty!";
+
+    w = _w;
+    h = _h;
+    next_row = 0;
+    path = file;
+    names = std::move(channels);
+    std::sort(names.begin(), names.end());
+    offsets.assign((h + block_rows - 1) / block_rows, 0);
+
+    // The header write() would produce, except for the full image size
+    std::string header;
+    header.append("\x76\x2f\x31\x01", 4);
+    put(header, (int32_t)2);
+
+    std::string chlist;
+    for(const std::string& name : names) {
+        chlist.append(name.c_str(), name.size() + 1);
+        put(chlist, (int32_t)TINYEXR_PIXELTYPE_FLOAT);
+        put(chlist, (int32_t)0); // pLinear and reserved
+        put(chlist, (int32_t)1); // x sampling
+        put(chlist, (int32_t)1); // y sampling
+    }
+    chlist.push_back('\0');
+    put_attribute(header, "channels", "chlist", chlist);
+    put_attribute(header, "compression", "compression",
+                  std::string(1, (char)TINYEXR_COMPRESSIONTYPE_ZIP));
+
+    std::string window;
+    put(window, (int32_t)0);
+    put(window, (int32_t)0);
+    put(window, (int32_t)w - 1);
+    put(window, (int32_t)h - 1);
+    put_attribute(header, "dataWindow", "box2i", window);
+    put_attribute(header, "displayWindow", "box2i", window);
+    put_attribute(header, "lineOrder", "lineOrder", std::string(1, '\0'));
+
+    std::string value;
+    put(value, 1.0f);
+    put_attribute(header, "pixelAspectRatio", "float", value);
+    value.clear();
+    put(value, 0.0f);
+    put(value, 0.0f);
+    put_attribute(header, "screenWindowCenter", "v2f", value);
+    value.clear();
+    put(value, 1.0f);
+    put_attribute(header, "screenWindowWidth", "float", value);
+    header.push_back('\0');
+
+    out.open(file, std::ios::binary);
+    if(!out.is_open()) return "Failed to open " + file + "!";
+    out.write(header.data(), header.size());
+
+    // Reserve the offset table
+    table = header.size();
+    out.write((const char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+    if(!out.good()) return "Failed to write " + file + "!";
+    return {};
+}
+
+std::string Stream_Writer::write_rows(std::vector<Channel> rows) {
+
+    if(!out.is_open()) return "Stream writer is not open!";
+
+    std::sort(rows.begin(), rows.end(),
+              [](const Channel& l, const Channel& r) { return l.name < r.name; });
+    if(rows.size() != names.size()) return "Rows have the wrong channels!";
+
+    size_t n = rows[0].data.size() / w;
+    for(size_t c = 0; c < rows.size(); c++) {
+        if(rows[c].name != names[c]) return "Rows have the wrong channels!";
+        if(rows[c].data.size() != n * w) return "Channel " + rows[c].name + " has the wrong size!";
+    }
+    if(n == 0) return {};
+    if(next_row + n > h) return "More rows than the image has!";
+    if(next_row % block_rows) return "Only the last band may have a partial block!";
+
+    // Let tinyexr compress the band as an image of its own, then move its
+    // blocks into place
+    std::vector<EXRChannelInfo> infos(rows.size());
+    std::vector<int> types(rows.size(), TINYEXR_PIXELTYPE_FLOAT);
+    std::vector<unsigned char*> images(rows.size());
+    for(size_t c = 0; c < rows.size(); c++) {
+        std::memset(&infos[c], 0, sizeof(EXRChannelInfo));
+        std::strncpy(infos[c].name, rows[c].name.c_str(), sizeof(infos[c].name) - 1);
+        images[c] = (unsigned char*)rows[c].data.data();
+    }
+
+    EXRHeader header;
+    InitEXRHeader(&header);
+    header.num_channels = (int)rows.size();
+    header.channels = infos.data();
+    header.pixel_types = types.data();
+    header.requested_pixel_types = types.data();
+    header.compression_type = TINYEXR_COMPRESSIONTYPE_ZIP;
+
+    EXRImage image;
+    InitEXRImage(&image);
+    image.num_channels = (int)rows.size();
+    image.images = images.data();
+    image.width = (int)w;
+    image.height = (int)n;
+
+    unsigned char* memory = nullptr;
+    const char* err = nullptr;
+    size_t size = SaveEXRImageToMemory(&image, &header, &memory, &err);
+    if(!size) {
+        std::string err_s = err ? err : "Unknown failure.";
+        if(err) FreeEXRErrorMessage(err);
+        return err_s;
+    }
+
+    // Skip the band's header to its offset table
+    size_t pos = 8;
+    while(pos < size && memory[pos]) {
+        pos += std::strlen((const char*)memory + pos) + 1;
+        pos += std::strlen((const char*)memory + pos) + 1;
+        pos += 4 + get<int32_t>(memory + pos);
+    }
+    pos++;
+
+    size_t blocks = (n + block_rows - 1) / block_rows;
+    for(size_t b = 0; b < blocks; b++) {
+        uint64_t block = get<uint64_t>(memory + pos + b * sizeof(uint64_t));
+        int32_t length = get<int32_t>(memory + block + 4);
+
+        offsets[next_row / block_rows + b] = (uint64_t)out.tellp();
+        int32_t y = (int32_t)(next_row + b * block_rows);
+        out.write((const char*)&y, sizeof(y));
+        out.write((const char*)&length, sizeof(length));
+        out.write((const char*)memory + block + 8, length);
+    }
+    free(memory);
+
+    next_row += n;
+    if(!out.good()) return "Failed to write " + path + "!";
+    return {};
+}
+
+std::string Stream_Writer::close() {
+
+    if(!out.is_open()) return {};
+
+    out.seekp(table);
+    out.write((const char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+    bool good = out.good();
+    out.close();
+
+    if(!good) return "Failed to write " + path + "!";
+    if(next_row < h) {
+        return "Only " + std::to_string(next_row) + " of " + std::to_string(h) + " rows written!";
+    }
+    return {};
+}
+
+size_t Stream_Writer::rows_written() const {
+    return next_row;
+}
+
+} // namespace EXR
@@ -0,0 +1,52 @@
+
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Writes linear float images with arbitrary channels (e.g. beauty plus AOVs)
+// to a single OpenEXR file, which tinyexr only supports through its
+// low-level header/image structs.
+namespace EXR {
+
+struct Channel {
+    std::string name;
+    std::vector<float> data; // w * h values, top row first
+};
+
+// Write a single-part scanline EXR with 32-bit float, ZIP compressed channels
+std::string write(std::string file, size_t w, size_t h, std::vector<Channel> channels);
+
+// Writes the same kind of file a band of rows at a time, top to bottom, so
+// the whole image never has to be in memory. Each band is compressed with
+// tinyexr and its blocks are appended to the file; the block offset table
+// is filled in by close().
+class Stream_Writer {
+public:
+    // Rows per compressed block. Every band but the last must be a multiple.
+    static const size_t block_rows = 16;
+
+    Stream_Writer() = default;
+    ~Stream_Writer();
+
+    std::string open(std::string file, size_t w, size_t h, std::vector<std::string> channels);
+    // The next rows of the image: the channels given to open, with w * rows
+    // values each, top row first
+    std::string write_rows(std::vector<Channel> rows);
+    // Fails if not every row was written
+    std::string close();
+
+    size_t rows_written() const;
+
+private:
+    std::ofstream out;
+    std::string path;
+    size_t w = 0, h = 0, next_row = 0;
+    std::vector<std::string> names;
+    std::vector<uint64_t> offsets;
+    uint64_t table = 0;
+};
+
+} // namespace EXR
@@ -1,7 +1,12 @@
 
 #include "hdr_image.h"
 #include "../lib/log.h"
+#include "thread_pool.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <limits>
 #include <sf_libs/stb_image.h>
 #include <sf_libs/tinyexr.h>
 
@@ -16,10 +21,14 @@ HDR_Image::HDR_Image(size_t w, size_t h) : w(w), h(h) {
 HDR_Image HDR_Image::copy() const {
     HDR_Image ret;
     ret.resize(w, h);
-    ret.pixels.insert(ret.pixels.begin(), pixels.begin(), pixels.end());
+    ret.pixels = pixels;
     ret.last_path = last_path;
     ret.dirty = true;
     ret.exposure = exposure;
+    // Give the source its id first, so the copy shares it even if nobody
+    // asked for one before
+    ret.id = content_id();
+    ret.id_stale = false;
     return ret;
 }
 
@@ -33,16 +42,19 @@ void HDR_Image::resize(size_t _w, size_t _h) {
     pixels.clear();
     pixels.resize(w * h);
     dirty = true;
+    id_stale = true;
 }
 
 void HDR_Image::clear(Spectrum color) {
     for(auto& s : pixels) s = color;
     dirty = true;
+    id_stale = true;
 }
 
 Spectrum& HDR_Image::at(size_t i) {
     assert(i < w * h);
     dirty = true;
+    id_stale = true;
     return pixels[i];
 }
 
@@ -55,6 +67,7 @@ Spectrum& HDR_Image::at(size_t x, size_t y) {
     assert(x < w && y < h);
     size_t idx = y * w + x;
     dirty = true;
+    id_stale = true;
     return pixels[idx];
 }
 
@@ -64,8 +77,35 @@ Spectrum HDR_Image::at(size_t x, size_t y) const {
     return pixels[idx];
 }
 
+namespace {
+
+// Linear value of each 8 bit gamma encoded code
+struct Linear_Table {
+    Linear_Table() {
+        for(int k = 0; k < 256; k++) values[k] = std::pow(k / 255.0f, GAMMA);
+    }
+    float values[256];
+};
+
+// The color, or black if any channel is infinite or NaN. Checks the exponent
+// bits, so it holds under fast math and compiles to a select.
+inline Spectrum finite_or_black(float r, float g, float b) {
+    uint32_t br, bg, bb;
+    std::memcpy(&br, &r, sizeof(float));
+    std::memcpy(&bg, &g, sizeof(float));
+    std::memcpy(&bb, &b, sizeof(float));
+    const uint32_t exp = 0x7f800000;
+    bool finite = ((br & exp) != exp) & ((bg & exp) != exp) & ((bb & exp) != exp);
+    return finite ? Spectrum(r, g, b) : Spectrum{};
+}
+
+} // namespace
+
 std::string HDR_Image::load_from(std::string file) {
 
+    // Both decoders give rows top first. The flip to bottom first, the gamma
+    // decode and the validity check are done together in one pass over the
+    // decoded data, split between the shared thread pool by rows.
     if(IsEXR(file.c_str()) == TINYEXR_SUCCESS) {
 
         int n_w, n_h;
@@ -87,47 +127,53 @@ std::string HDR_Image::load_from(std::string file) {
 
             resize(n_w, n_h);
 
-            for(size_t j = 0; j < h; j++) {
-                for(size_t i = 0; i < w; i++) {
-                    size_t didx = 4 * (j * w + i);
-                    size_t pidx = (h - j - 1) * w + i;
-                    pixels[pidx] = Spectrum(data[didx], data[didx + 1], data[didx + 2]);
-                    if(!pixels[pidx].valid()) pixels[pidx] = {};
+            Thread_Pool::get().parallel_for(0, h, 32, [&](size_t begin, size_t end) {
+                for(size_t j = begin; j < end; j++) {
+                    const float* src = data + 4 * j * w;
+                    Spectrum* dst = &pixels[(h - j - 1) * w];
+                    for(size_t i = 0; i < w; i++) {
+                        dst[i] = finite_or_black(src[4 * i], src[4 * i + 1], src[4 * i + 2]);
+                    }
                 }
-            }
+            });
 
             free(data);
         }
 
     } else {
 
-        stbi_set_flip_vertically_on_load(true);
+        static const Linear_Table linear;
 
         int n_w, n_h, channels;
         unsigned char* data = stbi_load(file.c_str(), &n_w, &n_h, &channels, 0);
 
         if(!data) return std::string(stbi_failure_reason());
-        if(channels < 3) return "Image has less than 3 color channels.";
+        if(channels < 3) {
+            stbi_image_free(data);
+            return "Image has less than 3 color channels.";
+        }
 
         resize(n_w, n_h);
 
-        for(size_t i = 0; i < w * h * channels; i += channels) {
-            float r = data[i] / 255.0f;
-            float g = data[i + 1] / 255.0f;
-            float b = data[i + 2] / 255.0f;
-            pixels[i / channels] = Spectrum(r, g, b);
-        }
+        // Every table entry is finite, so there is nothing to validate
+        size_t c = channels;
+        Thread_Pool::get().parallel_for(0, h, 32, [&](size_t begin, size_t end) {
+            for(size_t j = begin; j < end; j++) {
+                const unsigned char* src = data + c * j * w;
+                Spectrum* dst = &pixels[(h - j - 1) * w];
+                for(size_t i = 0; i < w; i++) {
+                    dst[i] = Spectrum(linear.values[src[c * i]], linear.values[src[c * i + 1]],
+                                      linear.values[src[c * i + 2]]);
+                }
+            }
+        });
 
         stbi_image_free(data);
-
-        for(size_t i = 0; i < pixels.size(); i++) {
-            pixels[i].make_linear();
-            if(!pixels[i].valid()) pixels[i] = {};
-        }
     }
 
     last_path = file;
     dirty = true;
+    id_stale = true;
     return {};
 }
 
@@ -135,6 +181,15 @@ std::string HDR_Image::loaded_from() const {
     return last_path;
 }
 
+uint64_t HDR_Image::content_id() const {
+    static std::atomic<uint64_t> next_id{1};
+    if(id_stale) {
+        id = next_id++;
+        id_stale = false;
+    }
+    return id;
+}
+
 void HDR_Image::tonemap(float e) const {
 
     if(e <= 0.0f) {
@@ -166,24 +221,103 @@ void HDR_Image::tonemap_to(std::vector<unsigned char>& data, float e) const {
 
     if(data.size() != w * h * 4) data.resize(w * h * 4);
 
-    for(size_t j = 0; j < h; j++) {
-        for(size_t i = 0; i < w; i++) {
+    Thread_Pool::get().parallel_for(0, h, 16, [&](size_t begin, size_t end) {
+        for(size_t j = begin; j < end; j++) {
+            tonemap_row(&pixels[(h - j - 1) * w], w, e, &data[4 * j * w]);
+        }
+    });
+}
+
+namespace {
+
+// e^-x for x >= 0, within a few float ulps. Branch free, so the loops
+// calling it can be vectorized.
+inline float exp_neg(float x) {
+
+    // e^-x = 2^n * 2^f with n an integer and |f| <= 1/2
+    float y = std::min(x, 87.0f) * -1.44269504f;
+    int n = (int)(y - 0.5f);
+    float f = (y - (float)n) * 0.69314718f;
+
+    // Taylor series of e^f, good to float precision for |f| <= ln(2) / 2
+    float p = 1.0f / 5040.0f;
+    p = p * f + 1.0f / 720.0f;
+    p = p * f + 1.0f / 120.0f;
+    p = p * f + 1.0f / 24.0f;
+    p = p * f + 1.0f / 6.0f;
+    p = p * f + 0.5f;
+    p = p * f + 1.0f;
+    p = p * f + 1.0f;
+
+    int32_t bits = (n + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(float));
+    return p * scale;
+}
+
+// Rounded 8 bit gamma encoding of values in [0,1] without a pow per channel.
+// The top bits of a value's float representation pick a bucket so narrow
+// that the code rises at most once inside it, so one comparison against the
+// linear value where the code steps up finishes the lookup.
+struct Gamma_Table {
+    // Buckets cover [2^-min_exp, 1] with 2^bucket_bits buckets per octave.
+    // Below that everything encodes to zero.
+    static const int min_exp = 20, bucket_bits = 8;
+    static const int n_buckets = (min_exp << bucket_bits) + 1;
+
+    Gamma_Table() {
+        for(int k = 1; k < 256; k++) {
+            thresholds[k] = std::pow((k - 0.5f) / 255.0f, GAMMA);
+        }
+        thresholds[0] = 0.0f;
+        thresholds[256] = std::numeric_limits<float>::infinity();
+
+        int code = 0;
+        for(int b = 0; b < n_buckets; b++) {
+            int32_t bits = (b + ((127 - min_exp) << bucket_bits)) << (23 - bucket_bits);
+            float lo;
+            std::memcpy(&lo, &bits, sizeof(float));
+            while(lo >= thresholds[code + 1]) code++;
+            base[b] = (unsigned char)code;
+        }
+    }
+    unsigned char encode(float v) const {
+        int32_t bits;
+        std::memcpy(&bits, &v, sizeof(float));
+        int b = (bits >> (23 - bucket_bits)) - ((127 - min_exp) << bucket_bits);
+        b = std::min(std::max(b, 0), n_buckets - 1);
+        int code = base[b];
+        return (unsigned char)(code + (v >= thresholds[code + 1]));
+    }
+    float thresholds[257];
+    unsigned char base[n_buckets];
+};
 
-            size_t pidx = (h - j - 1) * w + i;
-            const Spectrum& sample = pixels[pidx];
+} // namespace
 
-            float r = 1.0f - std::exp(-sample.r * exposure);
-            float g = 1.0f - std::exp(-sample.g * exposure);
-            float b = 1.0f - std::exp(-sample.b * exposure);
+void HDR_Image::tonemap_row(const Spectrum* row, size_t n, float e, unsigned char* rgba) {
 
-            Spectrum out(r, g, b);
-            out.make_srgb();
+    static const Gamma_Table gamma;
+    static const size_t chunk = 64;
 
-            size_t didx = 4 * (j * w + i);
-            data[didx] = (unsigned char)std::round(out.r * 255.0f);
-            data[didx + 1] = (unsigned char)std::round(out.g * 255.0f);
-            data[didx + 2] = (unsigned char)std::round(out.b * 255.0f);
-            data[didx + 3] = 255;
+    // Exposure mapping in its own pass over plain floats, which vectorizes
+    float mapped[3 * chunk];
+    for(size_t begin = 0; begin < n; begin += chunk) {
+        size_t m = std::min(chunk, n - begin);
+        for(size_t i = 0; i < m; i++) {
+            mapped[3 * i] = row[begin + i].r;
+            mapped[3 * i + 1] = row[begin + i].g;
+            mapped[3 * i + 2] = row[begin + i].b;
+        }
+        for(size_t i = 0; i < 3 * m; i++) {
+            mapped[i] = 1.0f - exp_neg(std::max(0.0f, mapped[i] * e));
+        }
+        unsigned char* out = rgba + 4 * begin;
+        for(size_t i = 0; i < m; i++) {
+            out[4 * i] = gamma.encode(mapped[3 * i]);
+            out[4 * i + 1] = gamma.encode(mapped[3 * i + 1]);
+            out[4 * i + 2] = gamma.encode(mapped[3 * i + 2]);
+            out[4 * i + 3] = 255;
         }
     }
 }
@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <vector>
 
 #include "../lib/spectrum.h"
@@ -31,9 +32,16 @@ public:
     std::string load_from(std::string file);
     std::string loaded_from() const;
 
+    // Unique for each distinct image content; copies share the id
+    uint64_t content_id() const;
+
     void tonemap_to(std::vector<unsigned char>& data, float exposure = 0.0f) const;
     const GL::Tex2D& get_texture(float exposure = 0.0f) const;
 
+    // Exposure map and gamma encode n linear values to RGBA8, as tonemap_to
+    // does for each row (which it splits between the shared thread pool)
+    static void tonemap_row(const Spectrum* row, size_t n, float exposure, unsigned char* rgba);
+
 private:
     void tonemap(float exposure = 0.0f) const;
 
@@ -44,4 +52,7 @@ private:
     mutable GL::Tex2D render_tex;
     mutable float exposure = 1.0f;
     mutable bool dirty = true;
+
+    mutable uint64_t id = 0;
+    mutable bool id_stale = true;
 };
@@ -0,0 +1,148 @@
+
+#include "packed_image.h"
+#include "../lib/log.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstring>
+
+const char* Pixel_Format_Names[(int)Pixel_Format::count] = {"Float", "Half", "RGBE"};
+
+namespace {
+
+uint16_t to_half(float f) {
+
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(float));
+    uint32_t sign = (x >> 16) & 0x8000;
+    x &= 0x7fffffff;
+
+    // Largest finite half; also catches infinity and NaN
+    if(x >= 0x477ff000) return (uint16_t)(sign | 0x7bff);
+
+    // Subnormal halves are multiples of 2^-24
+    if(x < 0x38800000) {
+        float a;
+        std::memcpy(&a, &x, sizeof(float));
+        return (uint16_t)(sign | (uint32_t)std::round(a * 16777216.0f));
+    }
+
+    // Rebias the exponent and round the mantissa to nearest even
+    uint32_t h = ((x - 0x38000000) + 0x0fff + ((x >> 13) & 1)) >> 13;
+    return (uint16_t)(sign | h);
+}
+
+float from_half(uint16_t h) {
+
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+
+    float f;
+    if(exp == 0) {
+        f = mantissa * (1.0f / 16777216.0f);
+        return sign ? -f : f;
+    }
+    uint32_t bits = sign | ((exp + 112) << 23) | (mantissa << 13);
+    std::memcpy(&f, &bits, sizeof(float));
+    return f;
+}
+
+uint32_t to_rgbe(Spectrum s) {
+
+    float v = std::max(std::max(s.r, s.g), s.b);
+    if(!(v >= 1e-32f)) return 0;
+
+    int e;
+    std::frexp(v, &e);
+    e = std::min(e, 127);
+    float scale = std::ldexp(1.0f, 8 - e);
+    auto mantissa = [scale](float c) {
+        return (uint32_t)std::min(std::max(c, 0.0f) * scale, 255.0f);
+    };
+    return mantissa(s.r) | mantissa(s.g) << 8 | mantissa(s.b) << 16 | (uint32_t)(e + 128) << 24;
+}
+
+Spectrum from_rgbe(uint32_t p) {
+
+    uint32_t e = p >> 24;
+    if(!e) return {};
+
+    // 2^(e - 128 - 8), with the mantissas taken at the middle of their step
+    uint32_t bits = (e - 9) << 23;
+    float f;
+    std::memcpy(&f, &bits, sizeof(float));
+    return Spectrum(((p & 0xff) + 0.5f) * f, (((p >> 8) & 0xff) + 0.5f) * f,
+                    (((p >> 16) & 0xff) + 0.5f) * f);
+}
+
+// Spreads the 3 bits of a tile coordinate to every other bit
+const uint32_t morton_spread[8] = {0, 1, 4, 5, 16, 17, 20, 21};
+
+} // namespace
+
+Packed_Image::Packed_Image(const HDR_Image& image, Pixel_Format format, bool tiled)
+    : fmt(format), tiled(tiled) {
+
+    std::tie(w, h) = image.dimension();
+    tiles_x = (w + tile_size - 1) / tile_size;
+    size_t tiles_y = (h + tile_size - 1) / tile_size;
+    size_t n = tiled ? tiles_x * tiles_y * tile_size * tile_size : w * h;
+
+    switch(fmt) {
+    case Pixel_Format::rgb32f: floats.resize(n); break;
+    case Pixel_Format::rgb16f: halves.resize(3 * n); break;
+    case Pixel_Format::rgbe: shared_exp.resize(n); break;
+    default: assert(false);
+    }
+
+    Thread_Pool::get().parallel_for(0, h, 32, [&](size_t begin, size_t end) {
+        for(size_t j = begin; j < end; j++) {
+            for(size_t i = 0; i < w; i++) {
+                Spectrum s = image.at(i, j);
+                size_t idx = index(i, j);
+                switch(fmt) {
+                case Pixel_Format::rgb32f: floats[idx] = s; break;
+                case Pixel_Format::rgb16f: {
+                    halves[3 * idx] = to_half(s.r);
+                    halves[3 * idx + 1] = to_half(s.g);
+                    halves[3 * idx + 2] = to_half(s.b);
+                } break;
+                case Pixel_Format::rgbe: shared_exp[idx] = to_rgbe(s); break;
+                default: break;
+                }
+            }
+        }
+    });
+}
+
+size_t Packed_Image::index(size_t x, size_t y) const {
+    if(!tiled) return y * w + x;
+    size_t tile = (y >> tile_bits) * tiles_x + (x >> tile_bits);
+    size_t mask = tile_size - 1;
+    return tile << (2 * tile_bits) | morton_spread[x & mask] | morton_spread[y & mask] << 1;
+}
+
+Spectrum Packed_Image::at(size_t x, size_t y) const {
+    assert(x < w && y < h);
+    size_t idx = index(x, y);
+    switch(fmt) {
+    case Pixel_Format::rgb16f:
+        return Spectrum(from_half(halves[3 * idx]), from_half(halves[3 * idx + 1]),
+                        from_half(halves[3 * idx + 2]));
+    case Pixel_Format::rgbe: return from_rgbe(shared_exp[idx]);
+    default: return floats[idx];
+    }
+}
+
+std::pair<size_t, size_t> Packed_Image::dimension() const {
+    return {w, h};
+}
+
+Pixel_Format Packed_Image::format() const {
+    return fmt;
+}
+
+size_t Packed_Image::memory() const {
+    return floats.size() * sizeof(Spectrum) + halves.size() * sizeof(uint16_t) +
+           shared_exp.size() * sizeof(uint32_t);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "../lib/spectrum.h"
+#include "hdr_image.h"
+
+// Storage of each pixel: 12 bytes of float, 6 of half float (clamped to
+// 65504), or 4 of shared exponent RGBE (Ward 1991, 8 bits of mantissa)
+enum class Pixel_Format : int { rgb32f, rgb16f, rgbe, count };
+extern const char* Pixel_Format_Names[(int)Pixel_Format::count];
+
+// Read-only copy of an HDR_Image in a compact format. Tiled images store
+// 8x8 pixel blocks contiguously, in Morton order within each block, so the
+// neighbors read by a bilinear lookup are usually in the same cache line.
+class Packed_Image {
+public:
+    Packed_Image() = default;
+    Packed_Image(const HDR_Image& image, Pixel_Format format, bool tiled = true);
+
+    Spectrum at(size_t x, size_t y) const;
+    std::pair<size_t, size_t> dimension() const;
+    Pixel_Format format() const;
+    // Bytes used by the pixels
+    size_t memory() const;
+
+private:
+    static const size_t tile_bits = 3, tile_size = 1 << tile_bits;
+
+    size_t index(size_t x, size_t y) const;
+
+    size_t w = 0, h = 0, tiles_x = 0;
+    Pixel_Format fmt = Pixel_Format::rgb32f;
+    bool tiled = false;
+
+    // Only the one matching the format is used
+    std::vector<Spectrum> floats;
+    std::vector<uint16_t> halves;
+    std::vector<uint32_t> shared_exp;
+};
@@ -3,16 +3,17 @@
 #include "../lib/mathlib.h"
 
 #include <ctime>
+#include <functional>
 #include <random>
 #include <thread>
 
 namespace RNG {
 
-static thread_local std::mt19937 rng;
+static thread_local Philox rng;
+static uint64_t render_seed = 0;
 
 float unit() {
-    std::uniform_real_distribution<float> d(0.0f, 1.0f);
-    return d(rng);
+    return rng.unit();
 }
 
 int integer(int min, int max) {
@@ -25,11 +26,84 @@ bool coin_flip(float p) {
 
 void seed() {
     std::random_device r;
-    std::random_device::result_type seed =
-        r() ^
-        (std::random_device::result_type)std::hash<std::thread::id>()(std::this_thread::get_id()) ^
-        (std::random_device::result_type)std::hash<time_t>()(std::time(nullptr));
-    rng.seed(seed);
+    uint64_t seed = ((uint64_t)r() << 32) ^ r() ^
+                    (uint64_t)std::hash<std::thread::id>()(std::this_thread::get_id()) ^
+                    (uint64_t)std::hash<time_t>()(std::time(nullptr));
+    rng = Philox(seed);
+}
+
+void seed(uint64_t s) {
+    rng = Philox(s);
+}
+
+void set_stream(uint64_t pixel, uint32_t sample) {
+    rng = Philox(render_seed, pixel, sample);
+}
+
+void set_render_seed(uint64_t s) {
+    render_seed = s;
+}
+
+uint64_t get_render_seed() {
+    return render_seed;
+}
+
+Philox::Philox(uint64_t k, uint64_t stream, uint32_t sub) {
+    key[0] = (uint32_t)k;
+    key[1] = (uint32_t)(k >> 32);
+    ctr[1] = sub;
+    ctr[2] = (uint32_t)stream;
+    ctr[3] = (uint32_t)(stream >> 32);
+}
+
+void Philox::round(uint32_t c[4], const uint32_t k[2]) {
+
+    static const uint64_t M0 = 0xD2511F53, M1 = 0xCD9E8D57;
+
+    uint64_t p0 = M0 * c[0];
+    uint64_t p1 = M1 * c[2];
+    uint32_t hi0 = (uint32_t)(p0 >> 32), lo0 = (uint32_t)p0;
+    uint32_t hi1 = (uint32_t)(p1 >> 32), lo1 = (uint32_t)p1;
+
+    uint32_t next[4] = {hi1 ^ c[1] ^ k[0], lo1, hi0 ^ c[3] ^ k[1], lo0};
+    c[0] = next[0];
+    c[1] = next[1];
+    c[2] = next[2];
+    c[3] = next[3];
+}
+
+void Philox::refill() {
+
+    static const uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;
+
+    uint32_t c[4] = {(uint32_t)(pos >> 2), ctr[1], ctr[2], ctr[3] ^ (uint32_t)(pos >> 34)};
+    uint32_t k[2] = {key[0], key[1]};
+    for(int i = 0; i < 10; i++) {
+        round(c, k);
+        k[0] += W0;
+        k[1] += W1;
+    }
+    for(int i = 0; i < 4; i++) out[i] = c[i];
+}
+
+uint32_t Philox::next() {
+    uint32_t i = (uint32_t)(pos & 3);
+    if(i == 0) refill();
+    pos++;
+    return out[i];
+}
+
+float Philox::unit() {
+    return (next() >> 8) * (1.0f / 16777216.0f);
+}
+
+uint64_t Philox::position() const {
+    return pos;
+}
+
+void Philox::seek(uint64_t p) {
+    pos = p;
+    if(pos & 3) refill();
 }
 
 } // namespace RNG
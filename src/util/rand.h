@@ -1,6 +1,7 @@
-
 #pragma once
 
+#include <cstdint>
+
 #include "../lib/mathlib.h"
 
 namespace RNG {
@@ -16,4 +17,42 @@ bool coin_flip(float p = 0.5f);
 
 // Seed the current thread's PRNG
 void seed();
+
+// Seed the current thread's PRNG deterministically
+void seed(uint64_t s);
+
+// Key the current thread's PRNG to the stream (pixel, sample) of the render
+// seed. Every subsequent call draws the next dimension of that stream, so
+// the values only depend on the key and not on which thread draws them.
+void set_stream(uint64_t pixel, uint32_t sample);
+
+// Set the seed used by set_stream (shared by all threads)
+void set_render_seed(uint64_t s);
+uint64_t get_render_seed();
+
+// Counter-based generator (Philox4x32-10). Output is a pure function of
+// (key, counter), so streams need no per-thread state beyond a counter.
+struct Philox {
+
+    Philox(uint64_t key = 0, uint64_t stream = 0, uint32_t sub = 0);
+
+    // Next 32 random bits
+    uint32_t next();
+    // Next float in [0,1)
+    float unit();
+    // Number of 32-bit words drawn so far
+    uint64_t position() const;
+    // Jump to an absolute position in the stream
+    void seek(uint64_t pos);
+
+private:
+    static void round(uint32_t ctr[4], const uint32_t key[2]);
+    void refill();
+
+    uint32_t key[2] = {};
+    uint32_t ctr[4] = {};
+    uint32_t out[4] = {};
+    uint64_t pos = 0;
+};
+
 } // namespace RNG
@@ -1,48 +1,240 @@
-
 #include "thread_pool.h"
 #include "../util/rand.h"
 
-Thread_Pool::Thread_Pool(size_t threads) {
-    start(threads);
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#endif
+
+// Identifies the pool and queue of the current worker thread, if any
+static thread_local const Thread_Pool* current_pool = nullptr;
+static thread_local size_t current_worker = 0;
+
+static size_t shared_threads = 0;
+static int shared_first_cpu = -1;
+
+static void pin_thread(std::thread& thread, size_t cpu) {
+#ifdef _WIN32
+    if(!SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << cpu)) {
+        warn("Failed to pin worker thread to CPU %zu.", cpu);
+    }
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set)) {
+        warn("Failed to pin worker thread to CPU %zu.", cpu);
+    }
+#else
+    (void)thread;
+    (void)cpu;
+    warn("Pinning threads is not supported on this platform.");
+#endif
+}
+
+Thread_Pool::Thread_Pool(size_t threads, int first_cpu) {
+    start(threads, first_cpu);
 }
 
 Thread_Pool::~Thread_Pool() {
     stop();
 }
 
-void Thread_Pool::start(size_t threads) {
-    n_threads = threads;
+Thread_Pool& Thread_Pool::get() {
+    static Thread_Pool pool(shared_threads ? shared_threads : std::thread::hardware_concurrency(),
+                            shared_first_cpu);
+    return pool;
+}
+
+void Thread_Pool::configure(size_t threads, int first_cpu) {
+    shared_threads = threads;
+    shared_first_cpu = first_cpu;
+}
+
+void Thread_Pool::start(size_t threads, int first_cpu) {
+    n_threads = std::max(threads, size_t(1));
     stop_now = false;
-    stop_when_done = false;
-    for(size_t i = 0; i < threads; i++)
-        workers.emplace_back([this] {
+    for(size_t i = 0; i < n_threads; i++) queues.push_back(std::make_unique<Queue>());
+    for(size_t i = 0; i < n_threads; i++) {
+        workers.emplace_back([this, i] {
             RNG::seed();
-            for(;;) {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> lock(this->queue_mutex);
-                    this->condition.wait(lock, [this] {
-                        return this->stop_now || this->stop_when_done || !this->tasks.empty();
-                    });
-                    if(this->stop_now || (this->stop_when_done && this->tasks.empty())) return;
-                    task = std::move(this->tasks.front());
-                    this->tasks.pop();
+            current_pool = this;
+            current_worker = i;
+            while(!stop_now) {
+                Task task;
+                if(pop(i, task)) {
+                    task.fn();
+                    finish(task);
+                    continue;
                 }
-                task();
+                std::unique_lock<std::mutex> lock(sleep_mutex);
+                condition.wait(lock, [this] { return stop_now || queued.load() > 0; });
             }
         });
+        if(first_cpu >= 0) pin_thread(workers.back(), first_cpu + i);
+    }
+}
+
+void Thread_Pool::push(std::function<void()> fn, Task_Group* group, Task_Priority priority) {
+
+    // Workers keep their own subtasks, which run before older work
+    bool local = current_pool == this;
+    size_t q = local ? current_worker : next_queue++ % n_threads;
+    int lane = (int)priority;
+    {
+        std::lock_guard<std::mutex> lock(queues[q]->mut);
+        if(local) {
+            queues[q]->lanes[lane].push_front({std::move(fn), group});
+        } else {
+            queues[q]->lanes[lane].push_back({std::move(fn), group});
+        }
+        if(group) {
+            group->pending++;
+            group->queued++;
+        }
+        pending++;
+        queued++;
+        lane_queued[lane]++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        condition.notify_one();
+    }
+    if(group) group->notify();
+}
+
+bool Thread_Pool::pop(size_t worker, Task& task, int max_lane) {
+
+    // Own queue first, then steal from the others
+    for(int lane = 0; lane <= max_lane; lane++) {
+        if(lane_queued[lane].load() == 0) continue;
+        for(size_t i = 0; i < n_threads; i++) {
+            Queue& queue = *queues[(worker + i) % n_threads];
+            std::lock_guard<std::mutex> lock(queue.mut);
+            auto& tasks = queue.lanes[lane];
+            if(tasks.empty()) continue;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+            if(task.group) task.group->queued--;
+            queued--;
+            lane_queued[lane]--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Thread_Pool::preempt(Task_Priority current) {
+    Task task;
+    while((int)current > 0 && pop(current_pool == this ? current_worker : 0, task,
+                                  (int)current - 1)) {
+        task.fn();
+        finish(task);
+    }
+}
+
+bool Thread_Pool::run_one(Task_Group* group) {
+
+    Task task;
+    for(int lane = 0; lane < n_lanes && !task.fn; lane++) {
+        for(size_t i = 0; i < n_threads && !task.fn; i++) {
+            std::lock_guard<std::mutex> lock(queues[i]->mut);
+            auto& tasks = queues[i]->lanes[lane];
+            auto entry = std::find_if(tasks.begin(), tasks.end(),
+                                      [group](const Task& t) { return t.group == group; });
+            if(entry == tasks.end()) continue;
+            task = std::move(*entry);
+            tasks.erase(entry);
+            group->queued--;
+            queued--;
+            lane_queued[lane]--;
+        }
+    }
+    if(!task.fn) return false;
+
+    task.fn();
+    finish(task);
+    return true;
+}
+
+void Thread_Pool::finish(Task& task) {
+
+    // Release whatever the task captured before anyone is told it's done
+    task.fn = nullptr;
+    if(task.group) task.group->finish(1);
+
+    if(--pending == 0) {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        idle.notify_all();
+    }
+}
+
+size_t Thread_Pool::drop(Task_Group* group) {
+
+    // Destroy the dropped tasks outside the locks
+    std::vector<Task> dropped;
+    for(size_t i = 0; i < queues.size(); i++) {
+        std::lock_guard<std::mutex> lock(queues[i]->mut);
+        for(int lane = 0; lane < n_lanes; lane++) {
+            auto& tasks = queues[i]->lanes[lane];
+            for(auto entry = tasks.begin(); entry != tasks.end();) {
+                if(group && entry->group != group) {
+                    entry++;
+                    continue;
+                }
+                if(entry->group) entry->group->queued--;
+                dropped.push_back(std::move(*entry));
+                entry = tasks.erase(entry);
+                queued--;
+                lane_queued[lane]--;
+            }
+        }
+    }
+
+    // Groups other than the one being cleared still count on these
+    std::vector<std::pair<Task_Group*, size_t>> counts;
+    for(Task& task : dropped) {
+        if(!task.group) continue;
+        if(counts.empty() || counts.back().first != task.group) counts.push_back({task.group, 0});
+        counts.back().second++;
+    }
+    size_t n = dropped.size();
+    dropped.clear();
+    for(auto [g, count] : counts) g->finish(count);
+
+    if(n && (pending -= n) == 0) {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        idle.notify_all();
+    }
+    return n;
+}
+
+void Thread_Pool::For_Group::work() {
+    for(size_t chunk = next++; chunk < chunks; chunk = next++) {
+        run(chunk);
+        if(++done == chunks) {
+            std::lock_guard<std::mutex> lock(mut);
+            finished.notify_all();
+        }
+    }
 }
 
 void Thread_Pool::clear() {
-    stop();
-    start(n_threads);
+    drop(nullptr);
 }
 
 void Thread_Pool::wait() {
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    idle.wait(lock, [this] { return pending.load() == 0; });
+}
+
+void Thread_Pool::stop() {
 
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop_when_done = true;
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        stop_now = true;
     }
 
     condition.notify_all();
@@ -50,23 +242,89 @@ void Thread_Pool::wait() {
         worker.join();
     }
     workers.clear();
+    drop(nullptr);
+    queues.clear();
+}
 
-    start(n_threads);
+Task_Group::Task_Group(Thread_Pool& pool, Task_Priority priority)
+    : pool(pool), priority(priority) {
 }
 
-void Thread_Pool::stop() {
+Task_Group::~Task_Group() {
+    wait();
+}
+
+void Task_Group::notify() {
+    std::lock_guard<std::mutex> lock(mut);
+    done.notify_all();
+}
+
+void Task_Group::finish(size_t n) {
 
+    // The group may be destroyed as soon as the lock is released
+    Thread_Pool& p = pool;
+    std::vector<std::function<void()>> next;
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop_now = true;
+        std::lock_guard<std::mutex> lock(mut);
+        if((pending -= n) > 0) return;
+        std::swap(next, continuations);
+        done.notify_all();
     }
+    for(auto& fn : next) p.enqueue(std::move(fn));
+}
 
-    condition.notify_all();
-    for(std::thread& worker : workers) {
-        worker.join();
+void Task_Group::wait() {
+    while(pending.load() > 0) {
+        if(pool.run_one(this)) continue;
+        std::unique_lock<std::mutex> lock(mut);
+        done.wait(lock, [this] { return pending.load() == 0 || queued.load() > 0; });
     }
-    workers.clear();
+    // Don't return while the last finish() still holds the lock
+    std::lock_guard<std::mutex> lock(mut);
+}
+
+void Task_Group::clear() {
+    pool.drop(this);
+}
+
+void Task_Group::then(std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lock(mut);
+        if(pending.load() > 0) {
+            continuations.push_back(std::move(fn));
+            return;
+        }
+    }
+    pool.enqueue(std::move(fn));
+}
+
+size_t Task_Graph::add(std::function<void()> fn, std::vector<size_t> after) {
+
+    size_t idx = nodes->size();
+    nodes->emplace_back();
+    Node& node = nodes->back();
+    node.fn = std::move(fn);
+    node.deps = after.size();
+    for(size_t dep : after) {
+        assert(dep < idx);
+        (*nodes)[dep].next.push_back(idx);
+    }
+    return idx;
+}
 
-    std::queue<std::function<void()>> empty;
-    std::swap(tasks, empty);
+void Task_Graph::start(Task_Group& group, Nodes nodes, size_t i) {
+    group.run([&group, nodes, i]() {
+        Node& node = (*nodes)[i];
+        node.fn();
+        for(size_t next : node.next) {
+            if(--(*nodes)[next].waiting == 0) start(group, nodes, next);
+        }
+    });
+}
+
+void Task_Graph::run(Task_Group& group) {
+    for(Node& node : *nodes) node.waiting = node.deps;
+    for(size_t i = 0; i < nodes->size(); i++) {
+        if((*nodes)[i].deps == 0) start(group, nodes, i);
+    }
 }
@@ -1,50 +1,199 @@
-
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <functional>
-#include <future>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <vector>
 
 #include "../lib/log.h"
 
+class Task_Group;
+
+// Queued tasks start from the highest lane down. Running tasks are not
+// interrupted, but long background tasks call Thread_Pool::preempt between
+// steps, so interactive work doesn't wait for them to finish.
+enum class Task_Priority : int { interactive, normal, background, count };
+
+// Each worker has its own task deques and steals from the others when it
+// runs out. Tasks enqueued from outside the pool are dealt out round-robin and
+// queues are served front to back, so they start roughly in enqueue order.
 class Thread_Pool {
 public:
-    Thread_Pool(size_t threads);
+    // Pins worker i to CPU first_cpu + i, unless first_cpu is negative
+    Thread_Pool(size_t threads, int first_cpu = -1);
     ~Thread_Pool();
 
+    // Pool shared by the pathtracers and the simulation. Separate work is
+    // kept apart with Task_Groups.
+    static Thread_Pool& get();
+    // Worker count (0 for one per hardware thread) and pinning of the shared
+    // pool. Only has an effect before the first call to get().
+    static void configure(size_t threads, int first_cpu = -1);
+
+    // Join all workers, dropping any pending tasks
     void stop();
+    // Block until every enqueued task has finished
     void wait();
+    // Drop pending tasks; running tasks finish and workers stay alive
     void clear();
 
-    template<class F, class... Args>
-    auto enqueue(F&& f, Args&&... args)
-        -> std::future<typename std::invoke_result<F, Args...>::type> {
+    template<class F> void enqueue(F&& f, Task_Priority priority = Task_Priority::normal) {
+        assert(!stop_now);
+        push(std::function<void()>(std::forward<F>(f)), nullptr, priority);
+    }
+
+    // Run queued tasks of a higher priority than the given one on the calling
+    // thread. Cheap when there are none.
+    void preempt(Task_Priority current);
+
+    // Calls fn(begin, end) on consecutive chunks of at most grain indices
+    // covering [first, last), and returns once all of them are done. The
+    // calling thread works on chunks too, so this may be used inside a task.
+    template<class F>
+    void parallel_for(size_t first, size_t last, size_t grain, F&& fn,
+                      Task_Priority priority = Task_Priority::normal) {
+
+        if(first >= last) return;
+        grain = std::max(grain, size_t(1));
 
-        using return_type = typename std::invoke_result<F, Args...>::type;
-        assert(!stop_now && !stop_when_done);
+        auto group = std::make_shared<For_Group>();
+        group->chunks = (last - first + grain - 1) / grain;
+        group->run = [&fn, first, last, grain](size_t chunk) {
+            size_t begin = first + chunk * grain;
+            fn(begin, std::min(begin + grain, last));
+        };
 
-        auto task = std::make_shared<std::packaged_task<return_type()>>(
-            std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+        size_t helpers = std::min(group->chunks - 1, n_threads);
+        for(size_t i = 0; i < helpers; i++) enqueue([group]() { group->work(); }, priority);
+        group->work();
+
+        std::unique_lock<std::mutex> lock(group->mut);
+        group->finished.wait(lock, [&group] { return group->done == group->chunks; });
+    }
 
-        std::future<return_type> res = task->get_future();
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            tasks.emplace([task]() { (*task)(); });
-        }
-        condition.notify_one();
-        return res;
+    size_t size() const {
+        return n_threads;
     }
 
 private:
-    void start(size_t);
+    friend class Task_Group;
+
+    // Chunks are claimed from a shared counter, so the loop finishes even if
+    // the helper tasks are dropped by clear()
+    struct For_Group {
+        void work();
+        size_t chunks = 0;
+        std::atomic<size_t> next{0}, done{0};
+        std::function<void(size_t)> run;
+        std::mutex mut;
+        std::condition_variable finished;
+    };
+
+    struct Task {
+        std::function<void()> fn;
+        Task_Group* group = nullptr;
+    };
+
+    static const int n_lanes = (int)Task_Priority::count;
+
+    struct Queue {
+        std::mutex mut;
+        std::deque<Task> lanes[n_lanes];
+    };
+
+    void start(size_t threads, int first_cpu);
+    void push(std::function<void()> fn, Task_Group* group, Task_Priority priority);
+    // Takes the first task of the highest non-empty lane up to the given one
+    bool pop(size_t worker, Task& task, int max_lane = n_lanes - 1);
+    // Run a queued task of the group on the calling thread, if there is one
+    bool run_one(Task_Group* group);
+    void finish(Task& task);
+    // Drop the queued tasks of the group (or all if null); returns how many
+    size_t drop(Task_Group* group);
+
     size_t n_threads;
-    bool stop_now = true;
-    bool stop_when_done = true;
-    std::mutex queue_mutex;
-    std::condition_variable condition;
+    std::atomic<bool> stop_now{true};
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::atomic<size_t> next_queue{0};
+    // Tasks waiting in the queues, and those plus the ones running
+    std::atomic<size_t> queued{0}, pending{0};
+    std::atomic<size_t> lane_queued[n_lanes] = {};
+
+    std::mutex sleep_mutex;
+    std::condition_variable condition, idle;
     std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
+};
+
+// Tasks that are waited on or dropped together, without affecting other work
+// in the pool. The group must outlive its tasks; destroying it waits for them.
+class Task_Group {
+public:
+    explicit Task_Group(Thread_Pool& pool, Task_Priority priority = Task_Priority::normal);
+    ~Task_Group();
+
+    Task_Group(const Task_Group&) = delete;
+    Task_Group& operator=(const Task_Group&) = delete;
+
+    template<class F> void run(F&& f) {
+        pool.push(std::function<void()>(std::forward<F>(f)), this, priority);
+    }
+    template<class F> void run(F&& f, Task_Priority p) {
+        pool.push(std::function<void()>(std::forward<F>(f)), this, p);
+    }
+
+    // Block until every task of the group has finished. The calling thread
+    // runs queued tasks of the group meanwhile.
+    void wait();
+    // Drop the group's queued tasks; running tasks finish
+    void clear();
+    // Enqueue f on the pool once the group has no unfinished tasks
+    void then(std::function<void()> f);
+
+    bool busy() const {
+        return pending.load() > 0;
+    }
+    Thread_Pool& get_pool() const {
+        return pool;
+    }
+
+private:
+    friend class Thread_Pool;
+    void finish(size_t n);
+    void notify();
+
+    Thread_Pool& pool;
+    Task_Priority priority;
+    std::atomic<size_t> pending{0}, queued{0};
+    std::mutex mut;
+    std::condition_variable done;
+    std::vector<std::function<void()>> continuations;
+};
+
+// Tasks with dependencies between them. Each task runs as soon as every task
+// it was added after has finished, so independent stages overlap.
+class Task_Graph {
+public:
+    // Returns the index of the task, for use in later calls
+    size_t add(std::function<void()> fn, std::vector<size_t> after = {});
+    // Start the graph's tasks on the group, which tracks their completion.
+    // A graph may only be running once at a time.
+    void run(Task_Group& group);
+
+private:
+    struct Node {
+        std::function<void()> fn;
+        std::vector<size_t> next;
+        size_t deps = 0;
+        std::atomic<size_t> waiting{0};
+    };
+    using Nodes = std::shared_ptr<std::deque<Node>>;
+    static void start(Task_Group& group, Nodes nodes, size_t i);
+
+    Nodes nodes = std::make_shared<std::deque<Node>>();
 };
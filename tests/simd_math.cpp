@@ -0,0 +1,270 @@
+// Checks and times the Vec4 and Mat4 operations that CARDINAL3D_SIMD_MATH
+// vectorizes. CMake builds this file twice, with and without SIMD math, since
+// both versions of the inline operators can't be linked into one program.
+//
+//     test_math_<mode> [--bench] [--write <file>] [--compare <file>]
+//
+// Every run checks max |M * M^-1 - I| over a fixed set of random matrices.
+// --write saves that residual and a small render to a file, and --compare
+// checks this build's residual and render against a file from the other one.
+
+// test_math_scalar stays scalar when the whole build uses SIMD math
+#ifdef CARDINAL3D_TEST_SCALAR_MATH
+#undef CARDINAL3D_SIMD_MATH
+#endif
+
+#include "lib/log.h"
+#include "lib/mathlib.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+#ifdef CARDINAL3D_SIMD
+const char* mode = "SIMD";
+#else
+const char* mode = "scalar";
+#endif
+
+// Largest |M * M^-1 - I| either build may have
+const float max_residual = 1e-4f;
+// Render channels further apart than this count as different pixels
+const float max_channel_diff = 1e-3f;
+// and at most this fraction of them may differ, at silhouettes
+const float max_diff_fraction = 0.005f;
+
+Vec3 random_vec(std::mt19937& rng, float lo, float hi) {
+    std::uniform_real_distribution<float> d(lo, hi);
+    float x = d(rng), y = d(rng), z = d(rng);
+    return Vec3(x, y, z);
+}
+
+// Half rigid transforms with some scale, half dense matrices kept away from
+// singular by a diagonal term
+std::vector<Mat4> random_matrices(size_t n) {
+
+    std::mt19937 rng(248);
+    std::uniform_real_distribution<float> entry(-1.0f, 1.0f), angle(0.0f, 360.0f);
+
+    std::vector<Mat4> ret(n);
+    for(size_t i = 0; i < n; i++) {
+        if(i % 2 == 0) {
+            float a = angle(rng);
+            Vec3 axis = random_vec(rng, -1.0f, 1.0f);
+            Vec3 t = random_vec(rng, -10.0f, 10.0f);
+            Vec3 s = random_vec(rng, 0.25f, 4.0f);
+            ret[i] = Mat4::translate(t) * Mat4::rotate(a, axis) * Mat4::scale(s);
+        } else {
+            for(int c = 0; c < 4; c++) {
+                for(int r = 0; r < 4; r++) ret[i][c][r] = entry(rng) + (c == r ? 3.0f : 0.0f);
+            }
+        }
+    }
+    return ret;
+}
+
+float inverse_residual(const std::vector<Mat4>& matrices) {
+    float ret = 0.0f;
+    for(const Mat4& m : matrices) {
+        Mat4 p = m * Mat4::inverse(m);
+        for(int c = 0; c < 4; c++) {
+            for(int r = 0; r < 4; r++) {
+                ret = std::max(ret, std::abs(p[c][r] - Mat4::I[c][r]));
+            }
+        }
+    }
+    return ret;
+}
+
+struct Ellipsoid {
+    Mat4 T, iT;
+    Vec3 albedo;
+};
+
+// Lit ellipsoids seen through a perspective camera. Rays come from unprojecting
+// pixels with the inverse view projection, hits from intersecting the unit
+// sphere in object space, and normals from the inverse transpose.
+std::vector<Vec3> render(size_t w, size_t h) {
+
+    std::vector<Ellipsoid> scene;
+    scene.push_back({Mat4::translate(Vec3(-1.5f, 0.0f, 0.0f)) *
+                         Mat4::rotate(30.0f, Vec3(0.0f, 0.0f, 1.0f)) *
+                         Mat4::scale(Vec3(1.0f, 0.5f, 0.75f)),
+                     {}, Vec3(0.8f, 0.3f, 0.2f)});
+    scene.push_back({Mat4::translate(Vec3(0.5f, 0.25f, -1.0f)) *
+                         Mat4::euler(Vec3(20.0f, 45.0f, 10.0f)) *
+                         Mat4::scale(Vec3(0.6f, 1.2f, 0.6f)),
+                     {}, Vec3(0.2f, 0.7f, 0.3f)});
+    scene.push_back({Mat4::translate(Vec3(0.0f, -101.0f, 0.0f)) * Mat4::scale(Vec3(100.0f)), {},
+                     Vec3(0.5f, 0.5f, 0.5f)});
+    for(Ellipsoid& e : scene) e.iT = Mat4::inverse(e.T);
+
+    Mat4 view = Mat4::look_at(Vec3(1.0f, 1.5f, 5.0f), Vec3(0.0f, 0.0f, -0.5f));
+    Mat4 proj = Mat4::project(50.0f, (float)w / h, 0.1f);
+    Mat4 iviewproj = Mat4::inverse(proj * view);
+    Vec3 to_light = Vec3(-1.0f, 2.0f, 1.5f).unit();
+
+    std::vector<Vec3> image(w * h);
+    for(size_t j = 0; j < h; j++) {
+        for(size_t i = 0; i < w; i++) {
+
+            float x = 2.0f * (i + 0.5f) / w - 1.0f, y = 2.0f * (j + 0.5f) / h - 1.0f;
+            Vec3 near = (iviewproj * Vec4(x, y, 1.0f, 1.0f)).project();
+            Vec3 far = (iviewproj * Vec4(x, y, 0.5f, 1.0f)).project();
+            Vec3 o = near, d = (far - near).unit();
+
+            float closest = std::numeric_limits<float>::infinity();
+            Vec3 color = Vec3(0.6f, 0.7f, 0.9f) * (0.5f + 0.5f * d.y);
+            for(const Ellipsoid& e : scene) {
+
+                // Object space ray, not normalized so t is shared with world space
+                Vec3 lo = (e.iT * Vec4(o, 1.0f)).xyz(), ld = (e.iT * Vec4(d, 0.0f)).xyz();
+                float a = dot(ld, ld), b = 2.0f * dot(lo, ld), c = dot(lo, lo) - 1.0f;
+                float disc = b * b - 4.0f * a * c;
+                if(disc < 0.0f) continue;
+                float t = (-b - std::sqrt(disc)) / (2.0f * a);
+                if(t <= 0.0f || t >= closest) continue;
+
+                closest = t;
+                Vec3 n = (Mat4::transpose(e.iT) * Vec4(lo + t * ld, 0.0f)).xyz().unit();
+                color = e.albedo * (0.1f + std::max(0.0f, dot(n, to_light)));
+            }
+            image[j * w + i] = color;
+        }
+    }
+    return image;
+}
+
+// Nanoseconds per call of op over an array of matrices
+template<typename Op> double time_op(const std::vector<Mat4>& matrices, Op&& op) {
+
+    static const size_t reps = 2000;
+    float sink = 0.0f;
+    auto start = std::chrono::steady_clock::now();
+    for(size_t r = 0; r < reps; r++) {
+        for(size_t i = 0; i < matrices.size(); i++) sink += op(matrices[i], i);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    // Keeps the loop from being optimized out
+    volatile float keep = sink;
+    (void)keep;
+    return std::chrono::duration<double, std::nano>(end - start).count() /
+           (reps * matrices.size());
+}
+
+void bench(const std::vector<Mat4>& matrices) {
+
+    size_t n = matrices.size();
+    info("%s Mat4 * Mat4: %.2f ns", mode, time_op(matrices, [&](const Mat4& m, size_t i) {
+             return (m * matrices[(i + 1) % n])[1][2];
+         }));
+    info("%s Mat4 * Vec4: %.2f ns", mode, time_op(matrices, [&](const Mat4& m, size_t i) {
+             return (m * matrices[(i + 1) % n][3]).x;
+         }));
+    info("%s transpose: %.2f ns", mode,
+         time_op(matrices, [](const Mat4& m, size_t) { return Mat4::transpose(m)[1][2]; }));
+    info("%s inverse: %.2f ns", mode,
+         time_op(matrices, [](const Mat4& m, size_t) { return Mat4::inverse(m)[1][2]; }));
+}
+
+bool write(const std::string& file, float residual, const std::vector<Vec3>& image) {
+    std::ofstream out(file, std::ios::binary);
+    out.write((const char*)&residual, sizeof(float));
+    out.write((const char*)image.data(), image.size() * sizeof(Vec3));
+    return out.good();
+}
+
+bool read(const std::string& file, float& residual, std::vector<Vec3>& image) {
+    std::ifstream in(file, std::ios::binary);
+    in.read((char*)&residual, sizeof(float));
+    in.read((char*)image.data(), image.size() * sizeof(Vec3));
+    return in.good();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+
+    static const size_t w = 96, h = 64;
+
+    bool run_bench = false;
+    std::string write_file, compare_file;
+    for(int i = 1; i < argc; i++) {
+        if(!std::strcmp(argv[i], "--bench")) {
+            run_bench = true;
+        } else if(!std::strcmp(argv[i], "--write") && i + 1 < argc) {
+            write_file = argv[++i];
+        } else if(!std::strcmp(argv[i], "--compare") && i + 1 < argc) {
+            compare_file = argv[++i];
+        } else {
+            warn("Usage: %s [--bench] [--write <file>] [--compare <file>]", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<Mat4> matrices = random_matrices(1024);
+    bool ok = true;
+
+    float residual = inverse_residual(matrices);
+    info("%s max |M * M^-1 - I|: %g", mode, residual);
+    if(!(residual <= max_residual)) {
+        warn("%s inverse residual is above %g", mode, max_residual);
+        ok = false;
+    }
+
+    std::vector<Vec3> image = render(w, h);
+
+    if(!write_file.empty() && !write(write_file, residual, image)) {
+        warn("Could not write %s", write_file.c_str());
+        ok = false;
+    }
+
+    if(!compare_file.empty()) {
+
+        float other_residual;
+        std::vector<Vec3> other(w * h);
+        if(!read(compare_file, other_residual, other)) {
+            warn("Could not read %s", compare_file.c_str());
+            return EXIT_FAILURE;
+        }
+
+        // The file comes from the other build; the SIMD inverse may not be
+        // much less accurate than the scalar one
+#ifdef CARDINAL3D_SIMD
+        float simd_residual = residual, scalar_residual = other_residual;
+#else
+        float simd_residual = other_residual, scalar_residual = residual;
+#endif
+        info("Other max |M * M^-1 - I|: %g", other_residual);
+        if(!(simd_residual <= 2.0f * scalar_residual + 1e-6f)) {
+            warn("SIMD inverse residual %g is well above scalar %g", simd_residual,
+                 scalar_residual);
+            ok = false;
+        }
+
+        size_t differ = 0;
+        float max_diff = 0.0f;
+        for(size_t i = 0; i < w * h; i++) {
+            Vec3 diff = image[i] - other[i];
+            float m = std::max(std::abs(diff.x), std::max(std::abs(diff.y), std::abs(diff.z)));
+            max_diff = std::max(max_diff, m);
+            if(!(m <= max_channel_diff)) differ++;
+        }
+        info("%zu of %zu pixels differ, largest channel difference %g", differ, w * h, max_diff);
+        if(differ > max_diff_fraction * w * h) {
+            warn("Renders differ in more than %g of pixels", max_diff_fraction);
+            ok = false;
+        }
+    }
+
+    if(run_bench) bench(matrices);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
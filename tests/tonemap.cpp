@@ -0,0 +1,80 @@
+// Checks HDR_Image::tonemap_row against the per-pixel exp and pow mapping it
+// replaced. Every channel must be within one 8 bit code of the old result.
+
+#include "lib/log.h"
+#include "util/hdr_image.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <random>
+
+namespace {
+
+// The old HDR_Image::tonemap_pixel
+void tonemap_pixel(Spectrum sample, float e, unsigned char* rgba) {
+
+    float r = 1.0f - std::exp(-sample.r * e);
+    float g = 1.0f - std::exp(-sample.g * e);
+    float b = 1.0f - std::exp(-sample.b * e);
+
+    Spectrum out(r, g, b);
+    out.make_srgb();
+
+    rgba[0] = (unsigned char)std::round(out.r * 255.0f);
+    rgba[1] = (unsigned char)std::round(out.g * 255.0f);
+    rgba[2] = (unsigned char)std::round(out.b * 255.0f);
+    rgba[3] = 255;
+}
+
+// Log-uniform radiance between 1e-7 and 1e4, plus some exact zeros
+float random_radiance(std::mt19937& rng) {
+    std::uniform_real_distribution<float> log_value(-7.0f, 4.0f);
+    if(rng() % 64 == 0) return 0.0f;
+    return std::pow(10.0f, log_value(rng));
+}
+
+} // namespace
+
+int main() {
+
+    static const size_t row_size = 1000, n_rows = 1000;
+    static const float exposures[] = {0.25f, 1.0f, 3.7f};
+
+    std::mt19937 rng(248);
+    std::vector<Spectrum> row(row_size);
+    std::vector<unsigned char> fast(4 * row_size), slow(4 * row_size);
+
+    size_t channels = 0, off_by_one = 0, wrong = 0;
+
+    for(float e : exposures) {
+        for(size_t j = 0; j < n_rows; j++) {
+
+            for(Spectrum& s : row) {
+                s = Spectrum(random_radiance(rng), random_radiance(rng), random_radiance(rng));
+            }
+            // Rows of different lengths cover the tail of the chunked loop
+            size_t n = row_size - j % 67;
+
+            HDR_Image::tonemap_row(row.data(), n, e, fast.data());
+            for(size_t i = 0; i < n; i++) tonemap_pixel(row[i], e, &slow[4 * i]);
+
+            for(size_t i = 0; i < 4 * n; i++) {
+                int diff = std::abs((int)fast[i] - (int)slow[i]);
+                if(diff == 1) {
+                    off_by_one++;
+                } else if(diff > 1) {
+                    if(wrong < 10) {
+                        Spectrum s = row[i / 4];
+                        warn("Pixel (%f, %f, %f) at exposure %f: channel %zu is %d, expected %d",
+                             s.r, s.g, s.b, e, i % 4, fast[i], slow[i]);
+                    }
+                    wrong++;
+                }
+            }
+            channels += 4 * n;
+        }
+    }
+
+    info("%zu channels, %zu off by one, %zu off by more", channels, off_by_one, wrong);
+    return wrong ? EXIT_FAILURE : EXIT_SUCCESS;
+}